@@ -21,26 +21,191 @@ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
 OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 SOFTWARE.
 
-  gcc -Wall epochfs.c `pkg-config fuse --cflags --libs` -o epochfs
+  gcc -Wall epochfs.c `pkg-config fuse3 --cflags --libs` -o epochfs
 */
 
-#define FUSE_USE_VERSION 29
+#define FUSE_USE_VERSION 312
 #define _GNU_SOURCE             /* feature_test_macros(7) 参照 */
 
-#include <fuse.h>
+#include <fuse_lowlevel.h>
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/statvfs.h>
 #include <sys/xattr.h>
 #include <sys/file.h>
+#include <sys/resource.h>
+#include <sys/inotify.h>
+#include <sys/sysmacros.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <dirent.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <syslog.h>
+#include <time.h>
+#ifdef EPOCHFS_HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+
+/*
+ * inodeテーブルのエントリ
+ * バッキングファイルをO_PATHで開いたハンドルを保持する。
+ * カーネルへ通知したlookup回数(nlookup)がforgetで0になった時点で解放する。
+ */
+struct epochfs_inode
+{
+	struct epochfs_inode *hnext;
+	struct epochfs_inode *wnext;	// inotifyのwatch descriptorのハッシュ
+	int fd;
+	int wd;				// 0は監視していないことを示す
+	dev_t dev;
+	ino_t ino;
+	uint64_t nlookup;
+	int backing_id;			// パススルーで登録したバッキングfd
+	unsigned int backing_refs;	// backing_idを使用中のopen数
+	unsigned int backing_writers;	// うち書き込み可能なopen数
+	struct epochfs_xattr_ent *xattrs;	// 拡張属性キャッシュ
+	char *link;			// シンボリックリンクの参照先
+};
+
+#define EPOCHFS_ITABLE_SIZE	4096
+
+// fi->fhの上位ビットで、パススルーで開いたことを示す。下位32bitはfd。
+#define EPOCHFS_FH_PASSTHROUGH	(1ULL << 32)
+
+/*
+ * 拡張属性キャッシュのエントリ
+ * inodeごとのリストで保持する。errが0でなければその名前の拡張属性が
+ * 取得できなかったこと(ENODATA等)を示す。
+ */
+struct epochfs_xattr_ent
+{
+	struct epochfs_xattr_ent *next;
+	uint64_t expire;
+	int err;
+	size_t size;
+	char *value;
+	char name[];
+};
+
+#define EPOCHFS_XCACHE_PER_INODE	8
+#define EPOCHFS_XCACHE_VALUE_MAX	4096
+
+/*
+ * 属性キャッシュのエントリ
+ * epoch時間を変換済みのstatを保持する。キーはst_dev, st_ino。
+ */
+struct epochfs_acache_ent
+{
+	struct epochfs_acache_ent *hnext;
+	struct stat st;
+	uint64_t expire;
+	int valid;
+	int referenced;
+};
+
+/*
+ * 属性キャッシュのシャード
+ * 固定数のスロットを持ち、満杯時はCLOCK方式で追い出す。
+ */
+struct epochfs_acache_shard
+{
+	pthread_mutex_t lock;
+	struct epochfs_acache_ent *ents;
+	struct epochfs_acache_ent **hash;
+	size_t nents;
+	size_t hand;
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t evictions;
+};
+
+#define EPOCHFS_ACACHE_SHARDS	16
+
+/*
+ * エントリキャッシュのエントリ
+ * 親ディレクトリの(st_dev, st_ino)と名前をキーとし、名前が指す
+ * (st_dev, st_ino)を記録する。ino=0はその名前が存在しなかったことを示す。
+ */
+struct epochfs_dcache_ent
+{
+	struct epochfs_dcache_ent *hnext;
+	struct epochfs_dcache_ent *lru_prev;
+	struct epochfs_dcache_ent *lru_next;
+	dev_t pdev;
+	ino_t pino;
+	dev_t dev;
+	ino_t ino;
+	uint64_t hash;
+	uint64_t expire;
+	char name[];
+};
+
+#define EPOCHFS_DCACHE_HASH_SIZE	16384
+
+#define EPOCHFS_TRASH_NAME	".epochfs-trash"
+// "<st_ino>.<ns>" を16進で表した名前の最大長 (終端を含む)
+#define EPOCHFS_TRASH_NAMELEN	sizeof("ffffffffffffffff.ffffffffffffffff")
+#define EPOCHFS_TRASH_STEP	(256ULL * 1024 * 1024)
+#define EPOCHFS_TRASH_RETRY	(60ULL * 1000000000)
+
+/*
+ * 遅延削除を待つファイル
+ * base_path直下のEPOCHFS_TRASH_NAMEへnameで移動済みのもの。
+ */
+struct epochfs_trash_ent
+{
+	struct epochfs_trash_ent *next;
+	dev_t dev;
+	ino_t ino;
+	uint64_t bytes;			// statfsで空きとして計上する量
+	uint64_t retry;			// 削除に失敗した場合の再試行時刻
+	char name[EPOCHFS_TRASH_NAMELEN];
+};
+
+// グループコミットを待つfsync要求
+struct epochfs_gsync_waiter
+{
+	struct epochfs_gsync_waiter *next;
+	struct epochfs_gsync_waiter *wnext;	// 同期スレッドのキュー
+	int syncfs;				// nextの要求もまとめてsyncfsする
+	fuse_req_t req;
+	int fd;
+	int datasync;
+	dev_t dev;
+};
+
+// flushの動作モード
+enum {
+	EPOCHFS_FLUSH_NONE,
+	EPOCHFS_FLUSH_CLOSE,
+	EPOCHFS_FLUSH_PERIODIC,
+};
+
+// 応答するinode番号
+enum {
+	EPOCHFS_INO_BACKING,		// バッキングファイルのst_inoをそのまま使う
+	EPOCHFS_INO_HASH,		// 別FSのst_inoは上位16bitをFSごとに分ける
+};
+
+#define EPOCHFS_INO_DEVS	64		// 対応表の初期サイズ
+#define EPOCHFS_INO_TAGS	0x10000		// タグ0はbase_pathのFS
+#define EPOCHFS_INO_MASK	0xffffffffffffULL
 
+// readdirplusの動作モード
+enum {
+	EPOCHFS_READDIRPLUS_NO,
+	EPOCHFS_READDIRPLUS_YES,
+	EPOCHFS_READDIRPLUS_AUTO,
+};
 
 struct epochfs_info
 {
@@ -48,12 +213,231 @@ struct epochfs_info
 	FILE *dbglog_stream;
 	char *basepathp;
 	int epoch;
+	double attr_timeout;
+	double entry_timeout;
+	int readdirplus;
+	double attr_cache_ttl;
+	unsigned int attr_cache_size;
+	double negative_timeout;
+	unsigned int neg_cache_size;
+	double entry_cache_ttl;
+	unsigned int entry_cache_size;
+	double xattr_cache_ttl;
+	int security_xattr;
+	int default_permissions;
+	int ino_mode;
+	int statx_dont_sync;
+	int as_root;
+	double statfs_cache_ttl;
+	unsigned long long statfs_cache_bytes;
+	int watch;
+	struct fuse_session *se;
+
+	// カーネルとネゴシエーションする機能
+	int parallel_dirops;
+	int async_dio;
+	int auto_inval_data;
+	int splice_read;
+	int splice_write;
+	int splice_move;
+	int passthrough;
+	int cache_symlinks;
+	int io_uring;
+	unsigned int io_uring_q_depth;
+	int backing_uring;
+	unsigned int backing_uring_depth;
+	int backing_uring_sqpoll;
+	int flush;
+	unsigned int flush_interval;
+	unsigned int fsync_window;
+	unsigned int fsync_batch;
+	int fsync_syncfs;
+	unsigned int fsync_threads;
+	int async_release;
+	unsigned int release_threads;
+	unsigned int release_queue;
+	unsigned long long trash_threshold;
+	unsigned int max_background;
+	unsigned int congestion_threshold;
+
+	// inodeテーブル (st_dev, st_ino をキーとするハッシュ)
+	struct epochfs_inode root;
+	pthread_mutex_t itable_lock;
+	struct epochfs_inode *itable[EPOCHFS_ITABLE_SIZE];
+	struct epochfs_inode *wtable[EPOCHFS_ITABLE_SIZE];
+	size_t itable_count;
+	uint64_t itable_hits;
+	uint64_t itable_misses;
+	rlim_t nofile_limit;
+	int nofile_warned;
+
+	// ベースディレクトリの監視
+	int watch_fd;
+	pthread_t watch_thread;
+	uint64_t watch_events;
+	uint64_t watch_overflows;
+	uint64_t watch_failures;
+	int watch_warned;
+
+	// バッキングファイルI/Oのio_uring
+#ifdef EPOCHFS_HAVE_LIBURING
+	struct io_uring uring;
+	pthread_mutex_t uring_lock;
+	pthread_t uring_thread;
+#endif
+	int uring_running;
+	uint64_t uring_inflight;
+	uint64_t uring_submits;
+	uint64_t uring_fallbacks;
+
+	// flush=periodicの同期スレッド
+	pthread_mutex_t syncer_lock;
+	pthread_cond_t syncer_cond;
+	pthread_t syncer_thread;
+	int syncer_running;
+	int syncer_fd;			// syncfsはO_PATHのfdを受け付けない
+	uint64_t syncer_syncs;
+	uint64_t syncer_errors;
+
+	// fsyncのグループコミット
+	pthread_mutex_t gsync_lock;
+	pthread_cond_t gsync_cond;
+	pthread_t gsync_thread;
+	int gsync_running;
+	struct epochfs_gsync_waiter *gsync_head;
+	struct epochfs_gsync_waiter **gsync_tail;
+	unsigned int gsync_count;
+	uint64_t gsync_requests;
+	uint64_t gsync_batches;
+	uint64_t gsync_syscalls;
+	pthread_cond_t gsync_work_cond;
+	pthread_t *gsync_workers;
+	unsigned int gsync_nworkers;
+	int gsync_workers_running;
+	struct epochfs_gsync_waiter *gsync_work_head;
+	struct epochfs_gsync_waiter **gsync_work_tail;
+
+	// 非同期close (closer_qはrelease_queue個のfdのリングバッファ)
+	pthread_mutex_t closer_lock;
+	pthread_cond_t closer_nonempty;
+	pthread_cond_t closer_nonfull;
+	pthread_t *closer_threads;
+	unsigned int closer_nthreads;
+	int closer_running;
+	int *closer_q;
+	unsigned int closer_head;
+	unsigned int closer_count;
+	uint64_t closer_closes;
+	uint64_t closer_errors;
+	uint64_t closer_waits;
+
+	// 遅延削除
+	int trash_fd;
+	pthread_mutex_t trash_lock;
+	pthread_cond_t trash_cond;
+	pthread_t trash_thread;
+	int trash_running;
+	struct epochfs_trash_ent *trash_list;
+	uint64_t trash_pending;
+	uint64_t trash_files;
+	uint64_t trash_deleted;
+
+	// 属性キャッシュ
+	// acache_genは無効化のたびに進め、無効化と競合したstatの登録を防ぐ
+	struct epochfs_acache_shard acache[EPOCHFS_ACACHE_SHARDS];
+	uint64_t acache_gen;
+
+	// ino=hashで使う、st_devとinode番号の上位16bitの対応
+	pthread_mutex_t ino_lock;
+	dev_t *ino_devs;
+	uint64_t *ino_tags;
+	unsigned int ino_ndevs;
+	unsigned int ino_cap;
+	uint8_t ino_used[EPOCHFS_INO_TAGS / 8];
+	int ino_warned;
+
+	// base_pathのFSのstatfsキャッシュ
+	pthread_mutex_t statfs_lock;
+	struct statvfs statfs_buf;
+	uint64_t statfs_expire;
+	uint64_t statfs_written;	// 取得後にwriteされたバイト数
+	uint64_t statfs_hits;
+	uint64_t statfs_misses;
+
+	// 拡張属性キャッシュ
+	pthread_mutex_t xcache_lock;
+	uint64_t xcache_gen;
+	uint64_t xcache_hits;
+	uint64_t xcache_misses;
+	uint64_t link_hits;
+	uint64_t link_misses;
+
+	// エントリキャッシュ (LRUは負と正で別。リストの先頭の次が最も新しい)
+	pthread_mutex_t dcache_lock;
+	struct epochfs_dcache_ent *dcache[EPOCHFS_DCACHE_HASH_SIZE];
+	struct epochfs_dcache_ent dcache_lru;
+	struct epochfs_dcache_ent dcache_pos_lru;
+	size_t dcache_count;
+	size_t dcache_pos_count;
+	uint64_t dcache_gen;
+	uint64_t dcache_neg_hits;
+	uint64_t dcache_neg_misses;
+	uint64_t dcache_pos_hits;
+	uint64_t dcache_pos_misses;
 };
 
 static struct epochfs_info epochfs = {
 	.base_path = "",
 	.dbglog_stream = NULL,
 	.epoch = 0,
+	.attr_timeout = 1.0,
+	.entry_timeout = 1.0,
+	.readdirplus = EPOCHFS_READDIRPLUS_AUTO,
+	.attr_cache_ttl = 0.0,
+	.attr_cache_size = 65536,
+	.negative_timeout = 0.0,
+	.neg_cache_size = 65536,
+	.entry_cache_ttl = 0.0,
+	.entry_cache_size = 65536,
+	.xattr_cache_ttl = 0.0,
+	.security_xattr = 1,
+	.parallel_dirops = 1,
+	.async_dio = 1,
+	.auto_inval_data = 1,
+	.splice_read = 1,
+	.splice_write = 1,
+	.passthrough = 1,
+	.cache_symlinks = 1,
+	.io_uring = 1,
+	.backing_uring_depth = 256,
+	.flush = EPOCHFS_FLUSH_NONE,
+	.flush_interval = 30,
+	.fsync_batch = 64,
+	.fsync_threads = 4,
+	.release_threads = 2,
+	.release_queue = 1024,
+	.root = { .fd = -1 },
+	.watch_fd = -1,
+	.trash_fd = -1,
+	.syncer_fd = -1,
+	.itable_lock = PTHREAD_MUTEX_INITIALIZER,
+	.syncer_lock = PTHREAD_MUTEX_INITIALIZER,
+	.syncer_cond = PTHREAD_COND_INITIALIZER,
+	.gsync_lock = PTHREAD_MUTEX_INITIALIZER,
+	.gsync_cond = PTHREAD_COND_INITIALIZER,
+	.gsync_work_cond = PTHREAD_COND_INITIALIZER,
+	.closer_lock = PTHREAD_MUTEX_INITIALIZER,
+	.closer_nonempty = PTHREAD_COND_INITIALIZER,
+	.closer_nonfull = PTHREAD_COND_INITIALIZER,
+	.trash_lock = PTHREAD_MUTEX_INITIALIZER,
+	.trash_cond = PTHREAD_COND_INITIALIZER,
+#ifdef EPOCHFS_HAVE_LIBURING
+	.uring_lock = PTHREAD_MUTEX_INITIALIZER,
+#endif
+	.dcache_lock = PTHREAD_MUTEX_INITIALIZER,
+	.xcache_lock = PTHREAD_MUTEX_INITIALIZER,
+	.statfs_lock = PTHREAD_MUTEX_INITIALIZER,
+	.ino_lock = PTHREAD_MUTEX_INITIALIZER,
 };
 
 
@@ -99,12 +483,14 @@ epochfs_dbg_init(void)
  * 共通処理
  * --------------------------------------------------------------------- */
 
+/*
+ * O_PATHハンドルでは直接操作できないシステムコール(open, chmod, truncate,
+ * xattr等)向けに、inode自身を指す/proc/self/fd/Nのパスを作成する。
+ */
 static inline void
-epochfs_mkfullpath(const char *pathname, char *fullpathname)
+epochfs_mkprocpath(struct epochfs_inode *inode, char *procpath)
 {
-	memcpy(fullpathname, epochfs.base_path, PATH_MAX);
-	strncat(fullpathname, pathname,
-		PATH_MAX - strlen((const char*)epochfs.base_path));
+	snprintf(procpath, PATH_MAX, "/proc/self/fd/%d", inode->fd);
 	return;
 }
 
@@ -154,648 +540,4362 @@ epochfs_epoch_local2unix(time_t time)
 	return  (time_t)(unix_t_ll - diff_epoch_ll);
 }
 
-/* ---------------------------------------------------------------------
- * filesystem操作
- * --------------------------------------------------------------------- */
-static int
-epochfs_statfs(const char *path, struct statvfs *buf)
+static inline void
+epochfs_stat_unix2local(struct stat *buf)
 {
-	int rc;
-	char fullpath[PATH_MAX];
-	epochfs_mkfullpath(path, fullpath);
+	// epoch時間をずらして応答する
+	buf->st_atime = epochfs_epoch_unix2local(buf->st_atime);
+	buf->st_mtime = epochfs_epoch_unix2local(buf->st_mtime);
+	buf->st_ctime = epochfs_epoch_unix2local(buf->st_ctime);
+}
 
-	EPOCHFS_DEBUG_LOG("path=%s", path);
+static inline void
+epochfs_statx_to_stat(const struct statx *stx, struct stat *st)
+{
+	memset(st, 0, sizeof(*st));
+	st->st_dev = makedev(stx->stx_dev_major, stx->stx_dev_minor);
+	st->st_ino = stx->stx_ino;
+	st->st_mode = stx->stx_mode;
+	st->st_nlink = stx->stx_nlink;
+	st->st_uid = stx->stx_uid;
+	st->st_gid = stx->stx_gid;
+	st->st_rdev = makedev(stx->stx_rdev_major, stx->stx_rdev_minor);
+	st->st_size = stx->stx_size;
+	st->st_blksize = stx->stx_blksize;
+	st->st_blocks = stx->stx_blocks;
+	st->st_atim.tv_sec = stx->stx_atime.tv_sec;
+	st->st_atim.tv_nsec = stx->stx_atime.tv_nsec;
+	st->st_mtim.tv_sec = stx->stx_mtime.tv_sec;
+	st->st_mtim.tv_nsec = stx->stx_mtime.tv_nsec;
+	st->st_ctim.tv_sec = stx->stx_ctime.tv_sec;
+	st->st_ctim.tv_nsec = stx->stx_ctime.tv_nsec;
+}
 
-	rc = statvfs(path, buf);
-	if (rc < 0) {
-		EPOCHFS_ERRNO_LOG(errno);
-		return -errno;
+static inline void
+epochfs_stat_to_statx(const struct stat *st, struct statx *stx)
+{
+	memset(stx, 0, sizeof(*stx));
+	stx->stx_mask = STATX_BASIC_STATS;
+	stx->stx_dev_major = major(st->st_dev);
+	stx->stx_dev_minor = minor(st->st_dev);
+	stx->stx_ino = st->st_ino;
+	stx->stx_mode = st->st_mode;
+	stx->stx_nlink = st->st_nlink;
+	stx->stx_uid = st->st_uid;
+	stx->stx_gid = st->st_gid;
+	stx->stx_rdev_major = major(st->st_rdev);
+	stx->stx_rdev_minor = minor(st->st_rdev);
+	stx->stx_size = st->st_size;
+	stx->stx_blksize = st->st_blksize;
+	stx->stx_blocks = st->st_blocks;
+	stx->stx_atime.tv_sec = st->st_atim.tv_sec;
+	stx->stx_atime.tv_nsec = st->st_atim.tv_nsec;
+	stx->stx_mtime.tv_sec = st->st_mtim.tv_sec;
+	stx->stx_mtime.tv_nsec = st->st_mtim.tv_nsec;
+	stx->stx_ctime.tv_sec = st->st_ctim.tv_sec;
+	stx->stx_ctime.tv_nsec = st->st_ctim.tv_nsec;
+}
+
+static inline void
+epochfs_statx_unix2local(struct statx *stx)
+{
+	// 作成時刻も取得できていればepoch時間をずらす
+	stx->stx_atime.tv_sec = epochfs_epoch_unix2local(stx->stx_atime.tv_sec);
+	stx->stx_mtime.tv_sec = epochfs_epoch_unix2local(stx->stx_mtime.tv_sec);
+	stx->stx_ctime.tv_sec = epochfs_epoch_unix2local(stx->stx_ctime.tv_sec);
+	if (stx->stx_mask & STATX_BTIME) {
+		stx->stx_btime.tv_sec =
+			epochfs_epoch_unix2local(stx->stx_btime.tv_sec);
 	}
-	return 0;
 }
 
-/* ---------------------------------------------------------------------
- * inode操作
- * --------------------------------------------------------------------- */
-static int
-epochfs_getattr(const char *pathname, struct stat *buf)
+static inline int
+epochfs_statx_flags(void)
 {
-	int rc;
-	char fullpathname[PATH_MAX];
-	epochfs_mkfullpath(pathname, fullpathname);
+	return AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW |
+	       (epochfs.statx_dont_sync ? AT_STATX_DONT_SYNC : 0);
+}
 
-	EPOCHFS_DEBUG_LOG("pathname=%s", pathname);
+/*
+ * fdが指すファイルの属性を取得する。statxでFUSEが使う項目だけを要求し、
+ * statx_dont_syncを指定した場合はNFS/CIFS等でもサーバへ再検証せず
+ * クライアントのキャッシュから応答させる。
+ */
+static inline int
+epochfs_stat_fd(int fd, struct stat *st)
+{
+	struct statx stx;
 
-	rc = lstat(fullpathname, buf);
-	if (rc < 0) {
-		return -errno;
+	if (statx(fd, "", epochfs_statx_flags(), STATX_BASIC_STATS, &stx) < 0) {
+		return -1;
 	}
-
-	// epoch時間をずらして応答する
-	buf->st_atime = epochfs_epoch_unix2local(buf->st_atime);
-	buf->st_mtime = epochfs_epoch_unix2local(buf->st_mtime);
-	buf->st_ctime = epochfs_epoch_unix2local(buf->st_ctime);
+	epochfs_statx_to_stat(&stx, st);
 	return 0;
 }
 
-static int
-epochfs_symlink(const char *target, const char *linkpath)
+static inline int
+epochfs_is_dot_or_dotdot(const char *name)
 {
-	int rc;
-	char fulllinkpath[PATH_MAX];
-	epochfs_mkfullpath(linkpath, fulllinkpath);
-
-	EPOCHFS_DEBUG_LOG("target=%s linkpath=%s", target, linkpath);
+	return name[0] == '.' &&
+	       (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'));
+}
 
-	rc = symlink(target, fulllinkpath);
-	if (rc < 0) {
-		EPOCHFS_ERRNO_LOG(errno);
-		return -errno;
+/*
+ * マウント先は1つのst_devに見えるため、base_path配下に別のFSがマウント
+ * されているとst_inoが衝突し、ハードリンクと誤認される。ino=hashでは
+ * base_pathのFSのst_inoはそのまま、それ以外は下位48bitにst_devの
+ * ハッシュから決めた16bitのタグを付ける。タグが衝突した場合は次の空き
+ * を使うため、FSが65535個までは別々のタグになる。
+ * タグはst_devと現れた順で決まるため、匿名デバイス番号のFS(btrfsの
+ * サブボリューム、NFS、tmpfs等)や、FSが現れる順が変わった場合は
+ * 再起動後に番号が変わる。
+ * 48bitに収まらないst_inoは衝突し得るため、初回のみ警告を出力する。
+ */
+static void
+epochfs_ino_warn(int bit, const char *msg, dev_t dev, ino_t ino)
+{
+	if (__atomic_fetch_or(&epochfs.ino_warned, bit, __ATOMIC_RELAXED) & bit) {
+		return;
 	}
-	return 0;
+	fuse_log(FUSE_LOG_WARNING, "epochfs: ino=hash: %s (dev=%u:%u ino=%lu)\n",
+		 msg, major(dev), minor(dev), (unsigned long)ino);
 }
 
-static int
-epochfs_readlink(const char *pathname, char *buf, size_t bufsiz)
+// ino_lockを保持して呼ぶ。割り当てられない場合は0を返す
+static uint64_t
+epochfs_ino_tag_new(dev_t dev)
 {
-	int rc;
-	char fullpathname[PATH_MAX];
-	epochfs_mkfullpath(pathname, fullpathname);
+	uint64_t tag;
+	unsigned int cap;
+	dev_t *devs;
+	uint64_t *tags;
 
-	EPOCHFS_DEBUG_LOG("pathname=%s", pathname);
+	if (epochfs.ino_ndevs == EPOCHFS_INO_TAGS - 1) {
+		return 0;
+	}
+	if (epochfs.ino_ndevs == epochfs.ino_cap) {
+		cap = epochfs.ino_cap ? epochfs.ino_cap * 2 : EPOCHFS_INO_DEVS;
+		devs = realloc(epochfs.ino_devs, cap * sizeof(*devs));
+		if (devs == NULL) {
+			return 0;
+		}
+		epochfs.ino_devs = devs;
+		tags = realloc(epochfs.ino_tags, cap * sizeof(*tags));
+		if (tags == NULL) {
+			return 0;
+		}
+		epochfs.ino_tags = tags;
+		epochfs.ino_cap = cap;
+	}
 
-	rc = readlink(fullpathname, buf, bufsiz);
-	if (rc < 0) {
-		EPOCHFS_ERRNO_LOG(errno);
-		return -errno;
+	tag = (uint64_t)dev * 0x9e3779b97f4a7c15ULL;	// Fibonacci hashing
+	tag = ((tag >> 48) % (EPOCHFS_INO_TAGS - 1)) + 1;
+	while (epochfs.ino_used[tag / 8] & (1 << (tag % 8))) {
+		tag = (tag % (EPOCHFS_INO_TAGS - 1)) + 1;
 	}
-	return 0;
+	epochfs.ino_used[tag / 8] |= 1 << (tag % 8);
+	epochfs.ino_devs[epochfs.ino_ndevs] = dev;
+	epochfs.ino_tags[epochfs.ino_ndevs] = tag;
+	epochfs.ino_ndevs++;
+	return tag;
 }
 
-static int
-epochfs_mknod(const char *pathname, mode_t mode, dev_t dev)
+static ino_t
+epochfs_map_ino(dev_t dev, ino_t ino)
 {
-	int rc;
-	char fullpathname[PATH_MAX];
-	epochfs_mkfullpath(pathname, fullpathname);
+	uint64_t tag = 0;
+	unsigned int i;
 
-	EPOCHFS_DEBUG_LOG("pathname=%s", pathname);
+	if (epochfs.ino_mode != EPOCHFS_INO_HASH) {
+		return ino;
+	}
+	if (dev == epochfs.root.dev) {
+		if ((uint64_t)ino > EPOCHFS_INO_MASK) {
+			epochfs_ino_warn(1, "base_path st_ino exceeds 48 bits "
+					 "and may collide", dev, ino);
+		}
+		return ino;
+	}
 
-	rc = mknod(fullpathname, mode, dev);
-	if (rc < 0) {
-		EPOCHFS_ERRNO_LOG(errno);
-		return -errno;
+	pthread_mutex_lock(&epochfs.ino_lock);
+	for (i = 0; i < epochfs.ino_ndevs; i++) {
+		if (epochfs.ino_devs[i] == dev) {
+			tag = epochfs.ino_tags[i];
+			break;
+		}
 	}
-	return 0;
+	if (tag == 0) {
+		tag = epochfs_ino_tag_new(dev);
+	}
+	pthread_mutex_unlock(&epochfs.ino_lock);
+
+	if (tag == 0) {
+		epochfs_ino_warn(2, "no tag left; st_ino is not mapped", dev, ino);
+		return ino;
+	}
+	if ((uint64_t)ino > EPOCHFS_INO_MASK) {
+		epochfs_ino_warn(4, "st_ino exceeds 48 bits and is truncated",
+				 dev, ino);
+	}
+	return (ino & EPOCHFS_INO_MASK) | (tag << 48);
 }
 
-static int
-epochfs_mkdir(const char *pathname, mode_t mode)
+static void
+epochfs_ino_free(void)
 {
-	int rc;
-	char fullpathname[PATH_MAX];
-	epochfs_mkfullpath(pathname, fullpathname);
+	free(epochfs.ino_devs);
+	free(epochfs.ino_tags);
+	epochfs.ino_devs = NULL;
+	epochfs.ino_tags = NULL;
+	epochfs.ino_ndevs = 0;
+	epochfs.ino_cap = 0;
+	memset(epochfs.ino_used, 0, sizeof(epochfs.ino_used));
+}
 
-	EPOCHFS_DEBUG_LOG("pathname=%s", pathname);
+// カーネルへ返す直前に呼ぶ。属性キャッシュにはバッキングのst_inoで登録する。
+static inline void
+epochfs_stat_map_ino(struct stat *st)
+{
+	st->st_ino = epochfs_map_ino(st->st_dev, st->st_ino);
+}
 
-	rc = mkdir(fullpathname, mode);
-	if (rc < 0) {
-		EPOCHFS_ERRNO_LOG(errno);
-		return -errno;
-	}
-	return 0;
+/*
+ * ゴミ箱のディレクトリはマウント先から見えないようにする。
+ * lookupではENOENTとし、その名前での作成・rename先・linkはEPERM、
+ * 削除・rename元はENOENTで拒否してゴミ箱自体を変更させない。
+ */
+static inline int
+epochfs_is_trash(struct epochfs_inode *dir, const char *name)
+{
+	return epochfs.trash_fd >= 0 && dir == &epochfs.root &&
+	       strcmp(name, EPOCHFS_TRASH_NAME) == 0;
 }
 
-static int
-epochfs_unlink(const char *pathname)
+static inline uint64_t
+epochfs_now_ns(void)
 {
-	int rc;
-	char fullpathname[PATH_MAX];
-	epochfs_mkfullpath(pathname, fullpathname);
+	struct timespec ts;
 
-	EPOCHFS_DEBUG_LOG("pathname=%s", pathname);
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
 
-	rc = unlink(fullpathname);
-	if (rc < 0) {
-		EPOCHFS_ERRNO_LOG(errno);
-		return -errno;
-	}
-	return 0;
+
+/* ---------------------------------------------------------------------
+ * 属性キャッシュ
+ * --------------------------------------------------------------------- */
+
+static inline struct epochfs_acache_shard *
+epochfs_acache_shard(dev_t dev, ino_t ino)
+{
+	return &epochfs.acache[(ino ^ dev) % EPOCHFS_ACACHE_SHARDS];
 }
 
-static int
-epochfs_rmdir(const char *pathname)
+static inline struct epochfs_acache_ent **
+epochfs_acache_head(struct epochfs_acache_shard *sh, dev_t dev, ino_t ino)
 {
-	int rc;
-	char fullpathname[PATH_MAX];
-	epochfs_mkfullpath(pathname, fullpathname);
+	return &sh->hash[((ino ^ dev) / EPOCHFS_ACACHE_SHARDS) % sh->nents];
+}
 
-	EPOCHFS_DEBUG_LOG("pathname=%s", pathname);
+static struct epochfs_acache_ent *
+epochfs_acache_find(struct epochfs_acache_shard *sh, dev_t dev, ino_t ino)
+{
+	struct epochfs_acache_ent *ent;
 
-	rc = rmdir(fullpathname);
-	if (rc < 0) {
-		EPOCHFS_ERRNO_LOG(errno);
-		return -errno;
+	for (ent = *epochfs_acache_head(sh, dev, ino);
+	     ent != NULL; ent = ent->hnext) {
+		if (ent->st.st_dev == dev && ent->st.st_ino == ino) {
+			return ent;
+		}
 	}
-	return 0;
+	return NULL;
 }
 
+static void
+epochfs_acache_unlink(struct epochfs_acache_shard *sh,
+		      struct epochfs_acache_ent *ent)
+{
+	struct epochfs_acache_ent **pp;
+
+	for (pp = epochfs_acache_head(sh, ent->st.st_dev, ent->st.st_ino);
+	     *pp != NULL; pp = &(*pp)->hnext) {
+		if (*pp == ent) {
+			*pp = ent->hnext;
+			break;
+		}
+	}
+	ent->valid = 0;
+}
 
 static int
-epochfs_rename(const char *oldpath, const char *newpath)
+epochfs_acache_init(void)
 {
-	int rc;
-	char fulloldpath[PATH_MAX];
-	char fullnewpath[PATH_MAX];
-	epochfs_mkfullpath(oldpath, fulloldpath);
-	epochfs_mkfullpath(newpath, fullnewpath);
-
-	EPOCHFS_DEBUG_LOG("oldpath=%s newpath=%s", oldpath, newpath);
+	struct epochfs_acache_shard *sh;
+	size_t nents;
+	int i;
 
-	rc = rename(fulloldpath, fullnewpath);
-	if (rc < 0) {
-		EPOCHFS_ERRNO_LOG(errno);
-		return -errno;
+	nents = epochfs.attr_cache_size / EPOCHFS_ACACHE_SHARDS;
+	if (nents == 0) {
+		nents = 1;
+	}
+	for (i = 0; i < EPOCHFS_ACACHE_SHARDS; i++) {
+		sh = &epochfs.acache[i];
+		pthread_mutex_init(&sh->lock, NULL);
+		if (epochfs.attr_cache_ttl <= 0) {
+			continue;
+		}
+		sh->ents = calloc(nents, sizeof(*sh->ents));
+		sh->hash = calloc(nents, sizeof(*sh->hash));
+		if (sh->ents == NULL || sh->hash == NULL) {
+			return -ENOMEM;
+		}
+		sh->nents = nents;
 	}
 	return 0;
 }
 
-static int
-epochfs_link(const char *oldpath, const char *newpath)
+static void
+epochfs_acache_free(void)
 {
-	int rc;
-	char fulloldpath[PATH_MAX];
-	char fullnewpath[PATH_MAX];
-	epochfs_mkfullpath(oldpath, fulloldpath);
-	epochfs_mkfullpath(newpath, fullnewpath);
-
-	EPOCHFS_DEBUG_LOG("oldpath=%s newpath=%s", oldpath, newpath);
+	int i;
 
-	rc = link(fulloldpath, fullnewpath);
-	if (rc < 0) {
-		EPOCHFS_ERRNO_LOG(errno);
-		return -errno;
+	for (i = 0; i < EPOCHFS_ACACHE_SHARDS; i++) {
+		free(epochfs.acache[i].ents);
+		free(epochfs.acache[i].hash);
+		epochfs.acache[i].ents = NULL;
+		epochfs.acache[i].hash = NULL;
+		epochfs.acache[i].nents = 0;
 	}
-	return 0;
 }
 
+// バッキングファイルをstatする前に取得し、epochfs_acache_put()に渡す
+static inline uint64_t
+epochfs_acache_gen(void)
+{
+	return __atomic_load_n(&epochfs.acache_gen, __ATOMIC_ACQUIRE);
+}
+
+// キャッシュから変換済みのstatを取得する。ヒットした場合は1を返す
 static int
-epochfs_chmod(const char *pathname, mode_t mode)
+epochfs_acache_get(dev_t dev, ino_t ino, struct stat *st)
 {
-	int rc;
-	char fullpathname[PATH_MAX];
-	epochfs_mkfullpath(pathname, fullpathname);
+	struct epochfs_acache_shard *sh = epochfs_acache_shard(dev, ino);
+	struct epochfs_acache_ent *ent;
 
-	EPOCHFS_DEBUG_LOG("pathname=%s", pathname);
+	if (sh->nents == 0) {
+		return 0;
+	}
 
-	rc = chmod(fullpathname, mode);
-	if (rc < 0) {
-		EPOCHFS_ERRNO_LOG(errno);
-		return -errno;
+	pthread_mutex_lock(&sh->lock);
+	ent = epochfs_acache_find(sh, dev, ino);
+	if (ent != NULL && ent->expire > epochfs_now_ns()) {
+		*st = ent->st;
+		ent->referenced = 1;
+		sh->hits++;
+		pthread_mutex_unlock(&sh->lock);
+		return 1;
 	}
+	sh->misses++;
+	pthread_mutex_unlock(&sh->lock);
 	return 0;
 }
 
-static int
-epochfs_chown(const char *pathname, uid_t owner, gid_t group)
+// 変換済みのstatを登録する。gen取得後に無効化があった場合は登録しない
+static void
+epochfs_acache_put(const struct stat *st, uint64_t gen)
 {
-	int rc;
-	char fullpathname[PATH_MAX];
-	epochfs_mkfullpath(pathname, fullpathname);
+	struct epochfs_acache_shard *sh;
+	struct epochfs_acache_ent *ent;
+	struct epochfs_acache_ent **head;
+	uint64_t now;
+
+	sh = epochfs_acache_shard(st->st_dev, st->st_ino);
+	if (sh->nents == 0) {
+		return;
+	}
 
-	EPOCHFS_DEBUG_LOG("pathname=%s", pathname);
+	now = epochfs_now_ns();
+	pthread_mutex_lock(&sh->lock);
+	if (epochfs_acache_gen() != gen) {
+		pthread_mutex_unlock(&sh->lock);
+		return;
+	}
 
-	rc = chown(fullpathname, owner, group);
-	if (rc < 0) {
-		EPOCHFS_ERRNO_LOG(errno);
-		return -errno;
+	ent = epochfs_acache_find(sh, st->st_dev, st->st_ino);
+	if (ent == NULL) {
+		// CLOCK: 参照ビットが立っていれば落として次へ進む
+		for (;;) {
+			ent = &sh->ents[sh->hand];
+			sh->hand = (sh->hand + 1) % sh->nents;
+			if (!ent->valid) {
+				break;
+			}
+			if (ent->referenced && ent->expire > now) {
+				ent->referenced = 0;
+				continue;
+			}
+			epochfs_acache_unlink(sh, ent);
+			sh->evictions++;
+			break;
+		}
+		head = epochfs_acache_head(sh, st->st_dev, st->st_ino);
+		ent->hnext = *head;
+		*head = ent;
+		ent->valid = 1;
 	}
-	return 0;
+	ent->st = *st;
+	ent->expire = now + (uint64_t)(epochfs.attr_cache_ttl * 1000000000.0);
+	ent->referenced = 0;
+	pthread_mutex_unlock(&sh->lock);
 }
 
-static int
-epochfs_truncate(const char *pathname, off_t length)
+static void
+epochfs_acache_inval(dev_t dev, ino_t ino)
 {
-	int rc;
-	char fullpathname[PATH_MAX];
-	epochfs_mkfullpath(pathname, fullpathname);
+	struct epochfs_acache_shard *sh = epochfs_acache_shard(dev, ino);
+	struct epochfs_acache_ent *ent;
 
-	EPOCHFS_DEBUG_LOG("pathname=%s", pathname);
+	if (sh->nents == 0) {
+		return;
+	}
 
-	rc = truncate(fullpathname, length);
-	if (rc < 0) {
-		EPOCHFS_ERRNO_LOG(errno);
-		return -errno;
+	__atomic_add_fetch(&epochfs.acache_gen, 1, __ATOMIC_RELEASE);
+	pthread_mutex_lock(&sh->lock);
+	ent = epochfs_acache_find(sh, dev, ino);
+	if (ent != NULL) {
+		epochfs_acache_unlink(sh, ent);
 	}
-	return 0;
+	pthread_mutex_unlock(&sh->lock);
 }
 
-static int
-epochfs_utime(const char *pathname, struct utimbuf *times)
+
+/* ---------------------------------------------------------------------
+ * 拡張属性キャッシュ
+ * --------------------------------------------------------------------- */
+
+/*
+ * カーネルは書き込みのたびにsecurity.capabilityをgetxattrするが、
+ * ほとんどはENODATAとなる。xattr_cache_ttlの間、inodeごとに取得結果を
+ * 負の結果も含めてキャッシュする。
+ */
+static void
+epochfs_xcache_free_ent(struct epochfs_xattr_ent *ent)
 {
-	int rc;
-	char fullpathname[PATH_MAX];
-	epochfs_mkfullpath(pathname, fullpathname);
+	free(ent->value);
+	free(ent);
+}
 
-	EPOCHFS_DEBUG_LOG("pathname=%s", pathname);
+// nameがNULLであれば値を持つエントリを、そうでなければnameのエントリを捨てる
+static void
+epochfs_xcache_drop(struct epochfs_inode *inode, const char *name)
+{
+	struct epochfs_xattr_ent **pp;
+	struct epochfs_xattr_ent *ent;
 
-	times->actime = epochfs_epoch_local2unix(times->actime);
-	times->modtime = epochfs_epoch_local2unix(times->modtime);
-	
-	rc = utime(fullpathname, times);
-	if (rc < 0) {
-		EPOCHFS_ERRNO_LOG(errno);
-		return -errno;
+	// 取得中のgetxattrが古い値を登録しないよう、どちらの場合も世代を進める
+	__atomic_add_fetch(&epochfs.xcache_gen, 1, __ATOMIC_RELEASE);
+	if (__atomic_load_n(&inode->xattrs, __ATOMIC_RELAXED) == NULL) {
+		return;
 	}
-	return 0;
+
+	pthread_mutex_lock(&epochfs.xcache_lock);
+	for (pp = &inode->xattrs; (ent = *pp) != NULL; ) {
+		if (name == NULL ? ent->err == 0 : strcmp(ent->name, name) == 0) {
+			*pp = ent->next;
+			epochfs_xcache_free_ent(ent);
+		} else {
+			pp = &ent->next;
+		}
+	}
+	pthread_mutex_unlock(&epochfs.xcache_lock);
 }
 
-static int
-epochfs_access(const char *pathname, int mode)
+static void
+epochfs_xcache_free(struct epochfs_inode *inode)
 {
-	int rc;
-	char fullpathname[PATH_MAX];
-	epochfs_mkfullpath(pathname, fullpathname);
-
-	EPOCHFS_DEBUG_LOG("pathname=%s", pathname);
+	struct epochfs_xattr_ent *ent;
 
-	rc = access(fullpathname, mode);
-	if (rc < 0) {
-		EPOCHFS_ERRNO_LOG(errno);
-		return -errno;
+	while ((ent = inode->xattrs) != NULL) {
+		inode->xattrs = ent->next;
+		epochfs_xcache_free_ent(ent);
 	}
-	return 0;
 }
 
+// epochfsを経由せずに拡張属性が変わった可能性がある場合に全て捨てる
+static void
+epochfs_xcache_clear(struct epochfs_inode *inode)
+{
+	__atomic_add_fetch(&epochfs.xcache_gen, 1, __ATOMIC_RELEASE);
+	pthread_mutex_lock(&epochfs.xcache_lock);
+	epochfs_xcache_free(inode);
+	pthread_mutex_unlock(&epochfs.xcache_lock);
+}
+
+static inline uint64_t
+epochfs_xcache_gen(void)
+{
+	return __atomic_load_n(&epochfs.xcache_gen, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * キャッシュにあればgetxattr(2)と同じ規約の結果を*retに入れて1を返す。
+ * 値はsizeが十分な場合のみvalueへコピーする。
+ */
 static int
-epochfs_setxattr(const char *path, const char *name, const char *value,
-		 size_t size, int flags)
+epochfs_xcache_get(struct epochfs_inode *inode, const char *name,
+		   char *value, size_t size, ssize_t *ret)
 {
-	int rc;
-	char fullpath[PATH_MAX];
-	epochfs_mkfullpath(path, fullpath);
+	struct epochfs_xattr_ent **pp;
+	struct epochfs_xattr_ent *ent;
+	int hit = 0;
 
-	EPOCHFS_DEBUG_LOG("path=%s name=%s value=%s size=%ld flags=%d",
-			  path, name, value, size, flags);
+	if (epochfs.xattr_cache_ttl <= 0) {
+		return 0;
+	}
 
-	rc = lsetxattr(fullpath, name, value, size, flags);
-	if (rc < 0) {
-		EPOCHFS_ERRNO_LOG(errno);
-		return -errno;
+	pthread_mutex_lock(&epochfs.xcache_lock);
+	for (pp = &inode->xattrs; (ent = *pp) != NULL; pp = &ent->next) {
+		if (strcmp(ent->name, name) == 0) {
+			break;
+		}
 	}
-	return 0;
+	if (ent != NULL && ent->expire <= epochfs_now_ns()) {
+		*pp = ent->next;
+		epochfs_xcache_free_ent(ent);
+		ent = NULL;
+	}
+	if (ent != NULL) {
+		hit = 1;
+		if (ent->err != 0) {
+			*ret = -ent->err;
+		} else if (size == 0) {
+			*ret = ent->size;
+		} else if (size < ent->size) {
+			*ret = -ERANGE;
+		} else {
+			memcpy(value, ent->value, ent->size);
+			*ret = ent->size;
+		}
+		epochfs.xcache_hits++;
+	} else {
+		epochfs.xcache_misses++;
+	}
+	pthread_mutex_unlock(&epochfs.xcache_lock);
+	return hit;
 }
 
-static int
-epochfs_getxattr(const char *path, const char *name, char *value, size_t size)
+// resはgetxattr(2)の結果(失敗時は-errno)。genは取得前に得たもの。
+static void
+epochfs_xcache_put(struct epochfs_inode *inode, const char *name,
+		   const char *value, ssize_t res, uint64_t gen)
 {
-	int rc;
-	char fullpath[PATH_MAX];
-	epochfs_mkfullpath(path, fullpath);
+	struct epochfs_xattr_ent **pp;
+	struct epochfs_xattr_ent *ent;
+	int n;
 
-	EPOCHFS_DEBUG_LOG("path=%s name=%s value=%s size=%ld",
-			  path, name, value, size);
+	if (epochfs.xattr_cache_ttl <= 0 ||
+	    (res < 0 && res != -ENODATA) || res > EPOCHFS_XCACHE_VALUE_MAX) {
+		return;
+	}
 
-	rc = lgetxattr(fullpath, name, value, size);
-	if (rc < 0) {
-		EPOCHFS_ERRNO_LOG(errno);
-		return -errno;
+	ent = calloc(1, sizeof(*ent) + strlen(name) + 1);
+	if (ent == NULL) {
+		return;
 	}
-	return 0;
+	strcpy(ent->name, name);
+	ent->expire = epochfs_now_ns() +
+		      (uint64_t)(epochfs.xattr_cache_ttl * 1000000000.0);
+	if (res < 0) {
+		ent->err = -res;
+	} else {
+		ent->size = res;
+		ent->value = malloc(res + 1);
+		if (ent->value == NULL) {
+			free(ent);
+			return;
+		}
+		memcpy(ent->value, value, res);
+	}
+
+	pthread_mutex_lock(&epochfs.xcache_lock);
+	if (epochfs_xcache_gen() != gen) {
+		pthread_mutex_unlock(&epochfs.xcache_lock);
+		epochfs_xcache_free_ent(ent);
+		return;
+	}
+	// 同名の古いエントリと、上限を超えた末尾のエントリを捨てる
+	for (pp = &inode->xattrs, n = 1; *pp != NULL; ) {
+		if (strcmp((*pp)->name, name) == 0 ||
+		    n >= EPOCHFS_XCACHE_PER_INODE) {
+			struct epochfs_xattr_ent *old = *pp;
+			*pp = old->next;
+			epochfs_xcache_free_ent(old);
+		} else {
+			pp = &(*pp)->next;
+			n++;
+		}
+	}
+	ent->next = inode->xattrs;
+	__atomic_store_n(&inode->xattrs, ent, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&epochfs.xcache_lock);
 }
 
+
+/* ---------------------------------------------------------------------
+ * inodeテーブル
+ * --------------------------------------------------------------------- */
+
+static inline struct epochfs_inode *
+epochfs_inode(fuse_ino_t ino)
+{
+	if (ino == FUSE_ROOT_ID) {
+		return &epochfs.root;
+	}
+	return (struct epochfs_inode *)(uintptr_t)ino;
+}
+
+static inline fuse_ino_t
+epochfs_inode_to_ino(struct epochfs_inode *inode)
+{
+	if (inode == &epochfs.root) {
+		return FUSE_ROOT_ID;
+	}
+	return (fuse_ino_t)(uintptr_t)inode;
+}
+
+static inline struct epochfs_inode **
+epochfs_itable_head(dev_t dev, ino_t ino)
+{
+	return &epochfs.itable[(ino ^ dev) % EPOCHFS_ITABLE_SIZE];
+}
+
+static inline struct epochfs_inode **
+epochfs_wtable_head(int wd)
+{
+	return &epochfs.wtable[(unsigned int)wd % EPOCHFS_ITABLE_SIZE];
+}
+
+/*
+ * (st_dev, st_ino) に対応するinodeを取得し、nlookupを1増やす。
+ * 既に登録済みの場合、fdは不要となるためcloseする。
+ */
+static struct epochfs_inode *
+epochfs_inode_get(int fd, const struct stat *st)
+{
+	struct epochfs_inode **head;
+	struct epochfs_inode *inode;
+
+	pthread_mutex_lock(&epochfs.itable_lock);
+	head = epochfs_itable_head(st->st_dev, st->st_ino);
+	for (inode = *head; inode != NULL; inode = inode->hnext) {
+		if (inode->dev == st->st_dev && inode->ino == st->st_ino) {
+			break;
+		}
+	}
+	if (inode != NULL) {
+		inode->nlookup++;
+		epochfs.itable_hits++;
+		pthread_mutex_unlock(&epochfs.itable_lock);
+		close(fd);
+		return inode;
+	}
+
+	inode = calloc(1, sizeof(*inode));
+	if (inode == NULL) {
+		pthread_mutex_unlock(&epochfs.itable_lock);
+		return NULL;
+	}
+	inode->fd = fd;
+	inode->dev = st->st_dev;
+	inode->ino = st->st_ino;
+	inode->nlookup = 1;
+	inode->hnext = *head;
+	*head = inode;
+	epochfs.itable_misses++;
+	epochfs.itable_count++;
+	if (!epochfs.nofile_warned &&
+	    epochfs.itable_count >= epochfs.nofile_limit / 10 * 9) {
+		epochfs.nofile_warned = 1;
+		fuse_log(FUSE_LOG_WARNING,
+			 "epochfs: %lu handles open, near RLIMIT_NOFILE=%lu\n",
+			 epochfs.itable_count,
+			 (unsigned long)epochfs.nofile_limit);
+	}
+	pthread_mutex_unlock(&epochfs.itable_lock);
+	return inode;
+}
+
+// 登録済みのinodeがあればnlookupを1増やして返す
+static struct epochfs_inode *
+epochfs_inode_ref(dev_t dev, ino_t ino)
+{
+	struct epochfs_inode *inode;
+
+	if (dev == epochfs.root.dev && ino == epochfs.root.ino) {
+		return &epochfs.root;
+	}
+
+	pthread_mutex_lock(&epochfs.itable_lock);
+	for (inode = *epochfs_itable_head(dev, ino); inode != NULL;
+	     inode = inode->hnext) {
+		if (inode->dev == dev && inode->ino == ino) {
+			inode->nlookup++;
+			epochfs.itable_hits++;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&epochfs.itable_lock);
+	return inode;
+}
+
+static void
+epochfs_inode_put(struct epochfs_inode *inode, uint64_t nlookup)
+{
+	int wd;
+	struct epochfs_inode **pp;
+
+	// ルートはアンマウントまで解放しない
+	if (inode == &epochfs.root) {
+		return;
+	}
+
+	pthread_mutex_lock(&epochfs.itable_lock);
+	inode->nlookup -= nlookup;
+	if (inode->nlookup != 0) {
+		pthread_mutex_unlock(&epochfs.itable_lock);
+		return;
+	}
+	for (pp = epochfs_itable_head(inode->dev, inode->ino);
+	     *pp != NULL; pp = &(*pp)->hnext) {
+		if (*pp == inode) {
+			*pp = inode->hnext;
+			break;
+		}
+	}
+	epochfs.itable_count--;
+	wd = inode->wd;
+	if (wd != 0) {
+		for (pp = epochfs_wtable_head(wd); *pp != NULL;
+		     pp = &(*pp)->wnext) {
+			if (*pp == inode) {
+				*pp = inode->wnext;
+				break;
+			}
+		}
+		inotify_rm_watch(epochfs.watch_fd, wd);
+	}
+	pthread_mutex_unlock(&epochfs.itable_lock);
+
+	close(inode->fd);
+	epochfs_xcache_free(inode);
+	free(inode->link);
+	free(inode);
+}
+
+static void
+epochfs_itable_free(void)
+{
+	struct epochfs_inode *inode;
+	int i;
+
+	for (i = 0; i < EPOCHFS_ITABLE_SIZE; i++) {
+		while ((inode = epochfs.itable[i]) != NULL) {
+			epochfs.itable[i] = inode->hnext;
+			epochfs.itable_count--;
+			close(inode->fd);
+			epochfs_xcache_free(inode);
+			free(inode->link);
+			free(inode);
+		}
+	}
+	epochfs_xcache_free(&epochfs.root);
+	if (epochfs.root.fd >= 0) {
+		close(epochfs.root.fd);
+		epochfs.root.fd = -1;
+	}
+}
+
+/*
+ * inodeテーブルはlookup済みの全inodeのO_PATHハンドルを保持するため、
+ * 深いツリーではfd数がRLIMIT_NOFILEに達しやすい。起動時にソフト
+ * リミットをハードリミットまで引き上げ、その9割に達したら警告する。
+ */
+static void
+epochfs_nofile_init(void)
+{
+	struct rlimit rl;
+
+	if (getrlimit(RLIMIT_NOFILE, &rl) < 0) {
+		epochfs.nofile_limit = 1024;
+		return;
+	}
+	if (rl.rlim_cur < rl.rlim_max) {
+		rl.rlim_cur = rl.rlim_max;
+		if (setrlimit(RLIMIT_NOFILE, &rl) < 0) {
+			getrlimit(RLIMIT_NOFILE, &rl);
+		}
+	}
+	epochfs.nofile_limit = rl.rlim_cur;
+}
+
+// /proc/self/fdを数え、プロセス全体で開いているfd数を返す
+static long
+epochfs_nofile_used(void)
+{
+	struct dirent *dent;
+	DIR *dp;
+	long n = 0;
+
+	dp = opendir("/proc/self/fd");
+	if (dp == NULL) {
+		return -1;
+	}
+	while ((dent = readdir(dp)) != NULL) {
+		if (dent->d_name[0] != '.') {
+			n++;
+		}
+	}
+	closedir(dp);
+	return n - 1;		// opendir自身のfdを除く
+}
+
+/*
+ * 書き込みでsecurity.capabilityが消えることはあっても増えることはない
+ * ため、拡張属性は値を持つエントリだけを捨てる。
+ */
+static inline void
+epochfs_inode_inval(struct epochfs_inode *inode)
+{
+	epochfs_acache_inval(inode->dev, inode->ino);
+	epochfs_xcache_drop(inode, NULL);
+}
+
+static inline int
+epochfs_passthrough_writing(struct epochfs_inode *inode)
+{
+	return __atomic_load_n(&inode->backing_writers, __ATOMIC_RELAXED) != 0;
+}
+
+/*
+ * パススルーが有効な場合、バッキングfdをカーネルに登録する。
+ * 登録後のread/write/mmapはカーネルがバッキングファイルへ直接行う。
+ * 同一inodeでパススルーと通常I/Oは混在できないため、backing_idは
+ * inode単位で共有する。登録に失敗した場合は通常のread/writeで処理する。
+ */
+static void
+epochfs_passthrough_open(fuse_req_t req, struct epochfs_inode *inode,
+			 struct fuse_file_info *fi)
+{
+#ifdef FUSE_CAP_PASSTHROUGH
+	int backing_id;
+
+	if (!epochfs.passthrough) {
+		return;
+	}
+
+	pthread_mutex_lock(&epochfs.itable_lock);
+	if (inode->backing_refs == 0) {
+		backing_id = fuse_passthrough_open(req, (int)fi->fh);
+		if (backing_id <= 0) {
+			pthread_mutex_unlock(&epochfs.itable_lock);
+			EPOCHFS_DEBUG_LOG("fd=%d passthrough unavailable",
+					  (int)fi->fh);
+			return;
+		}
+		inode->backing_id = backing_id;
+	}
+	inode->backing_refs++;
+	if ((fi->flags & O_ACCMODE) != O_RDONLY) {
+		__atomic_add_fetch(&inode->backing_writers, 1,
+				   __ATOMIC_RELAXED);
+	}
+	fi->backing_id = inode->backing_id;
+	fi->fh |= EPOCHFS_FH_PASSTHROUGH;
+	pthread_mutex_unlock(&epochfs.itable_lock);
+#endif
+}
+
+static void
+epochfs_passthrough_release(fuse_req_t req, struct epochfs_inode *inode,
+			    struct fuse_file_info *fi)
+{
+#ifdef FUSE_CAP_PASSTHROUGH
+	if (!(fi->fh & EPOCHFS_FH_PASSTHROUGH)) {
+		return;
+	}
+
+	pthread_mutex_lock(&epochfs.itable_lock);
+	if ((fi->flags & O_ACCMODE) != O_RDONLY) {
+		__atomic_sub_fetch(&inode->backing_writers, 1,
+				   __ATOMIC_RELAXED);
+	}
+	if (--inode->backing_refs == 0) {
+		fuse_passthrough_close(req, inode->backing_id);
+		inode->backing_id = 0;
+	}
+	pthread_mutex_unlock(&epochfs.itable_lock);
+
+	// 書き込み中に登録された属性は古い可能性がある
+	epochfs_inode_inval(inode);
+#endif
+}
+
+
+/* ---------------------------------------------------------------------
+ * エントリキャッシュ
+ * --------------------------------------------------------------------- */
+
+static inline uint64_t
+epochfs_dcache_hash(struct epochfs_inode *dir, const char *name)
+{
+	uint64_t hash = 14695981039346656037ULL;	// FNV-1a
+
+	for (; *name != '\0'; name++) {
+		hash = (hash ^ (unsigned char)*name) * 1099511628211ULL;
+	}
+	return hash ^ dir->ino ^ ((uint64_t)dir->dev << 32);
+}
+
+static struct epochfs_dcache_ent *
+epochfs_dcache_find(struct epochfs_inode *dir, const char *name,
+		    uint64_t hash)
+{
+	struct epochfs_dcache_ent *ent;
+
+	for (ent = epochfs.dcache[hash % EPOCHFS_DCACHE_HASH_SIZE];
+	     ent != NULL; ent = ent->hnext) {
+		if (ent->hash == hash && ent->pino == dir->ino &&
+		    ent->pdev == dir->dev && strcmp(ent->name, name) == 0) {
+			return ent;
+		}
+	}
+	return NULL;
+}
+
+static void
+epochfs_dcache_remove(struct epochfs_dcache_ent *ent)
+{
+	struct epochfs_dcache_ent **pp;
+
+	for (pp = &epochfs.dcache[ent->hash % EPOCHFS_DCACHE_HASH_SIZE];
+	     *pp != NULL; pp = &(*pp)->hnext) {
+		if (*pp == ent) {
+			*pp = ent->hnext;
+			break;
+		}
+	}
+	ent->lru_prev->lru_next = ent->lru_next;
+	ent->lru_next->lru_prev = ent->lru_prev;
+	if (ent->ino == 0) {
+		epochfs.dcache_count--;
+	} else {
+		epochfs.dcache_pos_count--;
+	}
+	free(ent);
+}
+
+static void
+epochfs_dcache_init(void)
+{
+	epochfs.dcache_lru.lru_next = &epochfs.dcache_lru;
+	epochfs.dcache_lru.lru_prev = &epochfs.dcache_lru;
+	epochfs.dcache_pos_lru.lru_next = &epochfs.dcache_pos_lru;
+	epochfs.dcache_pos_lru.lru_prev = &epochfs.dcache_pos_lru;
+}
+
+static void
+epochfs_dcache_free(void)
+{
+	while (epochfs.dcache_lru.lru_next != &epochfs.dcache_lru) {
+		epochfs_dcache_remove(epochfs.dcache_lru.lru_next);
+	}
+	while (epochfs.dcache_pos_lru.lru_next != &epochfs.dcache_pos_lru) {
+		epochfs_dcache_remove(epochfs.dcache_pos_lru.lru_next);
+	}
+}
+
+// 存在しないことがキャッシュされていれば1を返す
+static int
+epochfs_dcache_negative(struct epochfs_inode *dir, const char *name)
+{
+	struct epochfs_dcache_ent *ent;
+	uint64_t hash;
+	int hit = 0;
+
+	if (epochfs.negative_timeout <= 0) {
+		return 0;
+	}
+
+	hash = epochfs_dcache_hash(dir, name);
+	pthread_mutex_lock(&epochfs.dcache_lock);
+	ent = epochfs_dcache_find(dir, name, hash);
+	if (ent != NULL && ent->ino == 0) {
+		if (ent->expire > epochfs_now_ns()) {
+			hit = 1;
+		} else {
+			epochfs_dcache_remove(ent);
+		}
+	}
+	if (hit) {
+		epochfs.dcache_neg_hits++;
+	} else {
+		epochfs.dcache_neg_misses++;
+	}
+	pthread_mutex_unlock(&epochfs.dcache_lock);
+	return hit;
+}
+
+// lookup前に取得し、epochfs_dcache_add_negative()に渡す
+static inline uint64_t
+epochfs_dcache_gen(void)
+{
+	return __atomic_load_n(&epochfs.dcache_gen, __ATOMIC_ACQUIRE);
+}
+
+static void
+epochfs_dcache_insert(struct epochfs_inode *dir, const char *name,
+		      const struct stat *st, double ttl, uint64_t gen)
+{
+	struct epochfs_dcache_ent *ent;
+	struct epochfs_dcache_ent *lru;
+	struct epochfs_dcache_ent **head;
+	size_t *count;
+	size_t limit;
+	uint64_t hash;
+
+	if (st == NULL) {
+		lru = &epochfs.dcache_lru;
+		count = &epochfs.dcache_count;
+		limit = epochfs.neg_cache_size;
+	} else {
+		lru = &epochfs.dcache_pos_lru;
+		count = &epochfs.dcache_pos_count;
+		limit = epochfs.entry_cache_size;
+	}
+	if (ttl <= 0 || limit == 0) {
+		return;
+	}
+
+	hash = epochfs_dcache_hash(dir, name);
+	pthread_mutex_lock(&epochfs.dcache_lock);
+	if (epochfs_dcache_gen() != gen) {
+		pthread_mutex_unlock(&epochfs.dcache_lock);
+		return;
+	}
+	ent = epochfs_dcache_find(dir, name, hash);
+	if (ent != NULL) {
+		epochfs_dcache_remove(ent);
+	}
+	while (*count >= limit) {
+		epochfs_dcache_remove(lru->lru_prev);
+	}
+
+	ent = malloc(sizeof(*ent) + strlen(name) + 1);
+	if (ent == NULL) {
+		pthread_mutex_unlock(&epochfs.dcache_lock);
+		return;
+	}
+	ent->pdev = dir->dev;
+	ent->pino = dir->ino;
+	ent->dev = st != NULL ? st->st_dev : 0;
+	ent->ino = st != NULL ? st->st_ino : 0;
+	ent->hash = hash;
+	ent->expire = epochfs_now_ns() + (uint64_t)(ttl * 1000000000.0);
+	strcpy(ent->name, name);
+
+	head = &epochfs.dcache[hash % EPOCHFS_DCACHE_HASH_SIZE];
+	ent->hnext = *head;
+	*head = ent;
+	ent->lru_next = lru->lru_next;
+	ent->lru_prev = lru;
+	ent->lru_next->lru_prev = ent;
+	lru->lru_next = ent;
+	(*count)++;
+	pthread_mutex_unlock(&epochfs.dcache_lock);
+}
+
+static inline void
+epochfs_dcache_add_negative(struct epochfs_inode *dir, const char *name,
+			    uint64_t gen)
+{
+	epochfs_dcache_insert(dir, name, NULL, epochfs.negative_timeout, gen);
+}
+
+// stはlookupで得たバッキングファイルの属性
+static inline void
+epochfs_dcache_add(struct epochfs_inode *dir, const char *name,
+		   const struct stat *st, uint64_t gen)
+{
+	epochfs_dcache_insert(dir, name, st, epochfs.entry_cache_ttl, gen);
+}
+
+/*
+ * dir配下のnameが指す(st_dev, st_ino)がキャッシュされていれば1を返す。
+ * ヒットしたエントリはLRUの先頭へ移す。
+ */
+static int
+epochfs_dcache_positive(struct epochfs_inode *dir, const char *name,
+			dev_t *dev, ino_t *ino)
+{
+	struct epochfs_dcache_ent *ent;
+	uint64_t hash;
+	int hit = 0;
+
+	if (epochfs.entry_cache_ttl <= 0) {
+		return 0;
+	}
+
+	hash = epochfs_dcache_hash(dir, name);
+	pthread_mutex_lock(&epochfs.dcache_lock);
+	ent = epochfs_dcache_find(dir, name, hash);
+	if (ent != NULL && ent->ino != 0) {
+		if (ent->expire > epochfs_now_ns()) {
+			*dev = ent->dev;
+			*ino = ent->ino;
+			ent->lru_prev->lru_next = ent->lru_next;
+			ent->lru_next->lru_prev = ent->lru_prev;
+			ent->lru_next = epochfs.dcache_pos_lru.lru_next;
+			ent->lru_prev = &epochfs.dcache_pos_lru;
+			ent->lru_next->lru_prev = ent;
+			epochfs.dcache_pos_lru.lru_next = ent;
+			hit = 1;
+		} else {
+			epochfs_dcache_remove(ent);
+		}
+	}
+	if (hit) {
+		epochfs.dcache_pos_hits++;
+	} else {
+		epochfs.dcache_pos_misses++;
+	}
+	pthread_mutex_unlock(&epochfs.dcache_lock);
+	return hit;
+}
+
+// dir配下のnameが作成・削除・renameされた場合に呼び出す
+static void
+epochfs_dcache_inval(struct epochfs_inode *dir, const char *name)
+{
+	struct epochfs_dcache_ent *ent;
+	uint64_t hash;
+
+	if (epochfs.negative_timeout <= 0 && epochfs.entry_cache_ttl <= 0) {
+		return;
+	}
+
+	hash = epochfs_dcache_hash(dir, name);
+	__atomic_add_fetch(&epochfs.dcache_gen, 1, __ATOMIC_RELEASE);
+	pthread_mutex_lock(&epochfs.dcache_lock);
+	ent = epochfs_dcache_find(dir, name, hash);
+	if (ent != NULL) {
+		epochfs_dcache_remove(ent);
+	}
+	pthread_mutex_unlock(&epochfs.dcache_lock);
+}
+
+
+/* ---------------------------------------------------------------------
+ * ベースディレクトリの監視
+ * --------------------------------------------------------------------- */
+
+/*
+ * epochfsを経由せずにbase_path配下が更新された場合に、カーネルと
+ * デーモン内のキャッシュを無効化する。カーネルがキャッシュし得るのは
+ * lookup済みのディレクトリ配下だけなので、inodeテーブルに載っている
+ * ディレクトリをinotifyで監視すれば足りる。
+ */
+#define EPOCHFS_WATCH_MASK	(IN_CREATE | IN_DELETE | IN_MOVED_FROM | \
+				 IN_MOVED_TO | IN_ATTRIB | IN_MODIFY | \
+				 IN_CLOSE_WRITE | IN_EXCL_UNLINK)
+
+static void
+epochfs_watch_add(struct epochfs_inode *inode)
+{
+	char procpath[PATH_MAX];
+	int wd;
+	int err = 0;
+
+	if (epochfs.watch_fd < 0 || inode->wd != 0) {
+		return;
+	}
+
+	// 同じディレクトリのwdは再利用されるため、追加と削除はロック内で行う
+	epochfs_mkprocpath(inode, procpath);
+	pthread_mutex_lock(&epochfs.itable_lock);
+	if (inode->wd == 0) {
+		wd = inotify_add_watch(epochfs.watch_fd, procpath,
+				       EPOCHFS_WATCH_MASK);
+		if (wd > 0) {
+			inode->wd = wd;
+			inode->wnext = *epochfs_wtable_head(wd);
+			*epochfs_wtable_head(wd) = inode;
+		} else {
+			err = errno;
+		}
+	}
+	pthread_mutex_unlock(&epochfs.itable_lock);
+
+	/*
+	 * max_user_watchesに達した場合などは監視できない。このディレクトリ
+	 * 配下はepochfs外からの更新がタイムアウトまで見えないため、通知する。
+	 */
+	if (err != 0) {
+		__atomic_add_fetch(&epochfs.watch_failures, 1, __ATOMIC_RELAXED);
+		if (!__atomic_exchange_n(&epochfs.watch_warned, 1,
+					 __ATOMIC_RELAXED)) {
+			fuse_log(FUSE_LOG_WARNING,
+				 "epochfs: inotify_add_watch: %s; some directories "
+				 "are not watched\n", strerror(err));
+		}
+	}
+}
+
+// wdに対応するinodeの参照を取得する。呼び出し元でepochfs_inode_put()すること
+static struct epochfs_inode *
+epochfs_watch_get(int wd)
+{
+	struct epochfs_inode *inode;
+
+	pthread_mutex_lock(&epochfs.itable_lock);
+	for (inode = *epochfs_wtable_head(wd); inode != NULL;
+	     inode = inode->wnext) {
+		if (inode->wd == wd) {
+			if (inode != &epochfs.root) {
+				inode->nlookup++;
+			}
+			break;
+		}
+	}
+	pthread_mutex_unlock(&epochfs.itable_lock);
+	return inode;
+}
+
+static struct epochfs_inode *
+epochfs_itable_find(dev_t dev, ino_t ino)
+{
+	struct epochfs_inode *inode;
+
+	pthread_mutex_lock(&epochfs.itable_lock);
+	for (inode = *epochfs_itable_head(dev, ino); inode != NULL;
+	     inode = inode->hnext) {
+		if (inode->dev == dev && inode->ino == ino) {
+			break;
+		}
+	}
+	pthread_mutex_unlock(&epochfs.itable_lock);
+	return inode;
+}
+
+// イベントを取りこぼした場合は、lookup済みの全inodeを無効化する
+static void
+epochfs_watch_overflow(void)
+{
+	struct epochfs_inode *inode;
+	fuse_ino_t *inos;
+	size_t n = 0;
+	size_t cap = 1024;
+	size_t i;
+	int j;
+
+	__atomic_add_fetch(&epochfs.watch_overflows, 1, __ATOMIC_RELAXED);
+
+	inos = malloc(cap * sizeof(*inos));
+	pthread_mutex_lock(&epochfs.itable_lock);
+	for (j = 0; inos != NULL && j < EPOCHFS_ITABLE_SIZE; j++) {
+		for (inode = epochfs.itable[j]; inode != NULL;
+		     inode = inode->hnext) {
+			if (n == cap) {
+				fuse_ino_t *p = realloc(inos, cap * 2 * sizeof(*inos));
+				if (p == NULL) {
+					break;
+				}
+				inos = p;
+				cap *= 2;
+			}
+			epochfs_acache_inval(inode->dev, inode->ino);
+			inos[n++] = epochfs_inode_to_ino(inode);
+		}
+	}
+	pthread_mutex_unlock(&epochfs.itable_lock);
+
+	epochfs_acache_inval(epochfs.root.dev, epochfs.root.ino);
+	fuse_lowlevel_notify_inval_inode(epochfs.se, FUSE_ROOT_ID, 0, 0);
+	for (i = 0; i < n; i++) {
+		fuse_lowlevel_notify_inval_inode(epochfs.se, inos[i], 0, 0);
+	}
+	free(inos);
+
+	// どのディレクトリのエントリが変わったか分からないため全て捨てる
+	pthread_mutex_lock(&epochfs.dcache_lock);
+	__atomic_add_fetch(&epochfs.dcache_gen, 1, __ATOMIC_RELEASE);
+	epochfs_dcache_free();
+	pthread_mutex_unlock(&epochfs.dcache_lock);
+}
+
+static void
+epochfs_watch_event(const struct inotify_event *ev)
+{
+	struct epochfs_inode *dir;
+	struct epochfs_inode *child;
+	struct stat st;
+	fuse_ino_t parent;
+
+	__atomic_add_fetch(&epochfs.watch_events, 1, __ATOMIC_RELAXED);
+
+	if (ev->mask & IN_Q_OVERFLOW) {
+		epochfs_watch_overflow();
+		return;
+	}
+	if (ev->mask & IN_IGNORED) {
+		return;
+	}
+
+	dir = epochfs_watch_get(ev->wd);
+	if (dir == NULL) {
+		return;
+	}
+	parent = epochfs_inode_to_ino(dir);
+
+	// ディレクトリ自身の属性変更
+	if (ev->len == 0) {
+		epochfs_inode_inval(dir);
+		fuse_lowlevel_notify_inval_inode(epochfs.se, parent, -1, 0);
+		goto out;
+	}
+
+	if (ev->mask & (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO)) {
+		epochfs_inode_inval(dir);
+		epochfs_dcache_inval(dir, ev->name);
+		fuse_lowlevel_notify_inval_inode(epochfs.se, parent, -1, 0);
+		fuse_lowlevel_notify_inval_entry(epochfs.se, parent, ev->name,
+						 strlen(ev->name));
+	}
+
+	if (ev->mask & (IN_ATTRIB | IN_MODIFY | IN_CLOSE_WRITE)) {
+		if (fstatat(dir->fd, ev->name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+			goto out;
+		}
+		epochfs_acache_inval(st.st_dev, st.st_ino);
+		child = epochfs_itable_find(st.st_dev, st.st_ino);
+		if (child == NULL) {
+			goto out;
+		}
+		if (ev->mask & IN_ATTRIB) {
+			epochfs_xcache_clear(child);
+		}
+		/*
+		 * 書き込み中のIN_MODIFYでは属性のみ無効化し、ページキャッシュは
+		 * IN_CLOSE_WRITEで破棄する。epochfs自身の書き込みでも通知される
+		 * ため、書き込みのたびにキャッシュを捨てないようにしている。
+		 */
+		fuse_lowlevel_notify_inval_inode(epochfs.se,
+			epochfs_inode_to_ino(child),
+			(ev->mask & IN_CLOSE_WRITE) ? 0 : -1, 0);
+	}
+
+out:
+	epochfs_inode_put(dir, 1);
+}
+
+static void *
+epochfs_watch_thread(void *arg)
+{
+	char buf[64 * 1024]
+		__attribute__((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *ev;
+	ssize_t len;
+	char *p;
+
+	for (;;) {
+		len = read(epochfs.watch_fd, buf, sizeof(buf));
+		if (len < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			EPOCHFS_ERRNO_LOG(errno);
+			break;
+		}
+
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+		for (p = buf; p < buf + len;
+		     p += sizeof(struct inotify_event) + ev->len) {
+			ev = (const struct inotify_event *)p;
+			epochfs_watch_event(ev);
+		}
+		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+	}
+	return NULL;
+}
+
+static int
+epochfs_watch_init(void)
+{
+	if (!epochfs.watch) {
+		return 0;
+	}
+	epochfs.watch_fd = inotify_init1(IN_CLOEXEC);
+	if (epochfs.watch_fd < 0) {
+		return -errno;
+	}
+	return 0;
+}
+
+static int
+epochfs_watch_start(void)
+{
+	int rc;
+
+	if (epochfs.watch_fd < 0) {
+		return 0;
+	}
+	epochfs_watch_add(&epochfs.root);
+	rc = pthread_create(&epochfs.watch_thread, NULL,
+			    epochfs_watch_thread, NULL);
+	if (rc != 0) {
+		return -rc;
+	}
+	return 0;
+}
+
+static void
+epochfs_watch_stop(void)
+{
+	if (epochfs.watch_fd < 0) {
+		return;
+	}
+	pthread_cancel(epochfs.watch_thread);
+	pthread_join(epochfs.watch_thread, NULL);
+	close(epochfs.watch_fd);
+	epochfs.watch_fd = -1;
+}
+
+/*
+ * parent配下のnameを解決し、epoch時間をずらした属性とともに
+ * fuse_entry_paramを作成する。成功時はnlookupを1増やす。
+ */
+static int
+epochfs_do_lookup(fuse_ino_t parent, const char *name,
+		  struct fuse_entry_param *e)
+{
+	struct epochfs_inode *dir = epochfs_inode(parent);
+	struct epochfs_inode *inode;
+	uint64_t gen;
+	uint64_t dgen;
+	dev_t dev;
+	ino_t ino;
+	int fd;
+	int rc;
+
+	memset(e, 0, sizeof(*e));
+	e->attr_timeout = epochfs.attr_timeout;
+	e->entry_timeout = epochfs.entry_timeout;
+
+	if (epochfs_is_trash(dir, name)) {
+		return -ENOENT;
+	}
+
+	/*
+	 * (親, 名前)がキャッシュされていて、そのinodeがまだテーブルにあれば
+	 * ハンドルを開き直さずに済む。
+	 */
+	if (epochfs_dcache_positive(dir, name, &dev, &ino)) {
+		inode = epochfs_inode_ref(dev, ino);
+		if (inode != NULL) {
+			e->ino = epochfs_inode_to_ino(inode);
+			// パススルーで書き込み中はデーモンが書き込みを見ていない
+			if (!epochfs_passthrough_writing(inode) &&
+			    epochfs_acache_get(dev, ino, &e->attr)) {
+				epochfs_stat_map_ino(&e->attr);
+				return 0;
+			}
+			gen = epochfs_acache_gen();
+			rc = epochfs_stat_fd(inode->fd, &e->attr);
+			if (rc == 0) {
+				epochfs_stat_unix2local(&e->attr);
+				if (!epochfs_passthrough_writing(inode)) {
+					epochfs_acache_put(&e->attr, gen);
+				}
+				epochfs_stat_map_ino(&e->attr);
+				return 0;
+			}
+			epochfs_inode_put(inode, 1);
+			e->ino = 0;
+		}
+	}
+
+	dgen = epochfs_dcache_gen();
+	gen = epochfs_acache_gen();
+	fd = openat(dir->fd, name, O_PATH | O_NOFOLLOW);
+	if (fd < 0) {
+		return -errno;
+	}
+	rc = epochfs_stat_fd(fd, &e->attr);
+	if (rc < 0) {
+		rc = -errno;
+		close(fd);
+		return rc;
+	}
+
+	inode = epochfs_inode_get(fd, &e->attr);
+	if (inode == NULL) {
+		close(fd);
+		return -ENOMEM;
+	}
+	e->ino = epochfs_inode_to_ino(inode);
+	epochfs_dcache_add(dir, name, &e->attr, dgen);
+	if (S_ISDIR(e->attr.st_mode)) {
+		epochfs_watch_add(inode);
+	}
+	epochfs_stat_unix2local(&e->attr);
+	if (!epochfs_passthrough_writing(inode)) {
+		epochfs_acache_put(&e->attr, gen);
+	}
+	epochfs_stat_map_ino(&e->attr);
+	return 0;
+}
+
+static void
+epochfs_reply_entry(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	struct fuse_entry_param e;
+	int rc;
+
+	rc = epochfs_do_lookup(parent, name, &e);
+	if (rc < 0) {
+		fuse_reply_err(req, -rc);
+		return;
+	}
+	fuse_reply_entry(req, &e);
+}
+
+
+/* ---------------------------------------------------------------------
+ * バッキングファイルI/Oのio_uring
+ * --------------------------------------------------------------------- */
+
+/*
+ * backing_uringを指定した場合、open/read/fsync/getattrのシステムコールを
+ * io_uringへ投入して即座にFUSEワーカースレッドを返し、完了スレッドが
+ * 応答する。base_pathが遅いストレージ上にあっても、少数のスレッドで
+ * 多数のI/Oを並行させられる。SQが満杯の場合や、io_uringを使えない
+ * 場合は呼び出し元が同期的に処理する。
+ */
+enum {
+	EPOCHFS_URING_OPEN,
+	EPOCHFS_URING_READ,
+	EPOCHFS_URING_FSYNC,
+	EPOCHFS_URING_STATX,
+};
+
+struct epochfs_uring_req
+{
+	fuse_req_t req;
+	int op;
+	struct epochfs_inode *inode;
+	uint64_t gen;
+	struct fuse_file_info fi;
+	char *buf;
+	struct statx stx;
+	char procpath[PATH_MAX];
+};
+
+#ifdef EPOCHFS_HAVE_LIBURING
+static void
+epochfs_uring_complete(struct epochfs_uring_req *ur, int res)
+{
+	struct stat st;
+
+	if (res < 0) {
+		EPOCHFS_ERRNO_LOG(-res);
+		fuse_reply_err(ur->req, -res);
+		free(ur->buf);
+		return;
+	}
+
+	switch (ur->op) {
+	case EPOCHFS_URING_OPEN:
+		ur->fi.fh = (unsigned long)res;
+		if (ur->fi.flags & O_TRUNC) {
+			epochfs_inode_inval(ur->inode);
+		}
+		epochfs_passthrough_open(ur->req, ur->inode, &ur->fi);
+		fuse_reply_open(ur->req, &ur->fi);
+		break;
+	case EPOCHFS_URING_READ:
+		fuse_reply_buf(ur->req, ur->buf, res);
+		free(ur->buf);
+		break;
+	case EPOCHFS_URING_FSYNC:
+		fuse_reply_err(ur->req, 0);
+		break;
+	case EPOCHFS_URING_STATX:
+		epochfs_statx_to_stat(&ur->stx, &st);
+		epochfs_stat_unix2local(&st);
+		if (!epochfs_passthrough_writing(ur->inode)) {
+			epochfs_acache_put(&st, ur->gen);
+		}
+		epochfs_stat_map_ino(&st);
+		fuse_reply_attr(ur->req, &st, epochfs.attr_timeout);
+		break;
+	}
+}
+
+/*
+ * 完了スレッド
+ * user_dataがNULLのCQEは停止要求を示す。停止後も投入済みの要求が
+ * すべて完了するまで応答を続ける。
+ */
+static void *
+epochfs_uring_thread(void *arg)
+{
+	struct io_uring_cqe *cqe;
+	struct epochfs_uring_req *ur;
+	int stopping = 0;
+	int rc;
+
+	for (;;) {
+		if (stopping &&
+		    __atomic_load_n(&epochfs.uring_inflight,
+				    __ATOMIC_ACQUIRE) == 0) {
+			break;
+		}
+		rc = io_uring_wait_cqe(&epochfs.uring, &cqe);
+		if (rc < 0) {
+			if (rc == -EINTR) {
+				continue;
+			}
+			EPOCHFS_ERRNO_LOG(-rc);
+			break;
+		}
+		ur = io_uring_cqe_get_data(cqe);
+		rc = cqe->res;
+		io_uring_cqe_seen(&epochfs.uring, cqe);
+
+		if (ur == NULL) {
+			stopping = 1;
+			continue;
+		}
+		epochfs_uring_complete(ur, rc);
+		free(ur);
+		__atomic_sub_fetch(&epochfs.uring_inflight, 1, __ATOMIC_RELEASE);
+	}
+	return NULL;
+}
+
+/*
+ * SQEを確保する。成功した場合はuring_lockを保持したまま返すため、
+ * 準備後にepochfs_uring_submit()を呼ぶこと。
+ */
+static struct io_uring_sqe *
+epochfs_uring_get_sqe(void)
+{
+	struct io_uring_sqe *sqe;
+
+	if (!epochfs.uring_running) {
+		return NULL;
+	}
+
+	pthread_mutex_lock(&epochfs.uring_lock);
+	if (!epochfs.uring_running) {
+		pthread_mutex_unlock(&epochfs.uring_lock);
+		return NULL;
+	}
+	sqe = io_uring_get_sqe(&epochfs.uring);
+	if (sqe == NULL) {
+		io_uring_submit(&epochfs.uring);
+		sqe = io_uring_get_sqe(&epochfs.uring);
+	}
+	if (sqe == NULL) {
+		pthread_mutex_unlock(&epochfs.uring_lock);
+		__atomic_add_fetch(&epochfs.uring_fallbacks, 1,
+				   __ATOMIC_RELAXED);
+	}
+	return sqe;
+}
+
+static void
+epochfs_uring_submit(struct io_uring_sqe *sqe, struct epochfs_uring_req *ur)
+{
+	io_uring_sqe_set_data(sqe, ur);
+	if (ur != NULL) {
+		__atomic_add_fetch(&epochfs.uring_inflight, 1,
+				   __ATOMIC_RELAXED);
+	}
+	io_uring_submit(&epochfs.uring);
+	pthread_mutex_unlock(&epochfs.uring_lock);
+	__atomic_add_fetch(&epochfs.uring_submits, 1, __ATOMIC_RELAXED);
+}
+
+static struct epochfs_uring_req *
+epochfs_uring_req_new(fuse_req_t req, int op, struct epochfs_inode *inode)
+{
+	struct epochfs_uring_req *ur;
+
+	if (!epochfs.uring_running) {
+		return NULL;
+	}
+	ur = calloc(1, sizeof(*ur));
+	if (ur == NULL) {
+		return NULL;
+	}
+	ur->req = req;
+	ur->op = op;
+	ur->inode = inode;
+	return ur;
+}
+
+/*
+ * 以下の関数は要求を投入した場合に0を返し、応答は完了スレッドが行う。
+ * 負の値を返した場合、呼び出し元が同期的に処理する。
+ */
+static int
+epochfs_uring_open(fuse_req_t req, struct epochfs_inode *inode,
+		   struct fuse_file_info *fi)
+{
+	struct epochfs_uring_req *ur;
+	struct io_uring_sqe *sqe;
+
+	ur = epochfs_uring_req_new(req, EPOCHFS_URING_OPEN, inode);
+	if (ur == NULL) {
+		return -1;
+	}
+	ur->fi = *fi;
+	epochfs_mkprocpath(inode, ur->procpath);
+
+	sqe = epochfs_uring_get_sqe();
+	if (sqe == NULL) {
+		free(ur);
+		return -1;
+	}
+	io_uring_prep_openat(sqe, AT_FDCWD, ur->procpath,
+			     fi->flags & ~O_NOFOLLOW, 0);
+	epochfs_uring_submit(sqe, ur);
+	return 0;
+}
+
+static int
+epochfs_uring_read(fuse_req_t req, int fd, size_t count, off_t offset)
+{
+	struct epochfs_uring_req *ur;
+	struct io_uring_sqe *sqe;
+
+	ur = epochfs_uring_req_new(req, EPOCHFS_URING_READ, NULL);
+	if (ur == NULL) {
+		return -1;
+	}
+	ur->buf = malloc(count);
+	if (ur->buf == NULL) {
+		free(ur);
+		return -1;
+	}
+
+	sqe = epochfs_uring_get_sqe();
+	if (sqe == NULL) {
+		free(ur->buf);
+		free(ur);
+		return -1;
+	}
+	io_uring_prep_read(sqe, fd, ur->buf, count, offset);
+	epochfs_uring_submit(sqe, ur);
+	return 0;
+}
+
+static int
+epochfs_uring_fsync(fuse_req_t req, int fd, int datasync)
+{
+	struct epochfs_uring_req *ur;
+	struct io_uring_sqe *sqe;
+
+	ur = epochfs_uring_req_new(req, EPOCHFS_URING_FSYNC, NULL);
+	if (ur == NULL) {
+		return -1;
+	}
+
+	sqe = epochfs_uring_get_sqe();
+	if (sqe == NULL) {
+		free(ur);
+		return -1;
+	}
+	io_uring_prep_fsync(sqe, fd, datasync ? IORING_FSYNC_DATASYNC : 0);
+	epochfs_uring_submit(sqe, ur);
+	return 0;
+}
+
+// fdはO_PATHハンドルでもよい
+static int
+epochfs_uring_getattr(fuse_req_t req, struct epochfs_inode *inode, int fd)
+{
+	struct epochfs_uring_req *ur;
+	struct io_uring_sqe *sqe;
+
+	ur = epochfs_uring_req_new(req, EPOCHFS_URING_STATX, inode);
+	if (ur == NULL) {
+		return -1;
+	}
+	ur->gen = epochfs_acache_gen();
+
+	sqe = epochfs_uring_get_sqe();
+	if (sqe == NULL) {
+		free(ur);
+		return -1;
+	}
+	io_uring_prep_statx(sqe, fd, "", epochfs_statx_flags(),
+			    STATX_BASIC_STATS, &ur->stx);
+	epochfs_uring_submit(sqe, ur);
+	return 0;
+}
+
+/*
+ * io_uringを初期化し完了スレッドを起動する。SQPOLLのカーネルスレッドは
+ * 作成したプロセスに属するため、fuse_daemonize()の後に呼ぶこと。
+ * 失敗した場合は同期処理のまま動作を続ける。
+ */
+static void
+epochfs_uring_start(void)
+{
+	struct io_uring_params params;
+	int rc;
+
+	if (!epochfs.backing_uring) {
+		return;
+	}
+
+	memset(&params, 0, sizeof(params));
+	if (epochfs.backing_uring_sqpoll) {
+		params.flags |= IORING_SETUP_SQPOLL;
+		params.sq_thread_idle = 1000;
+	}
+	rc = io_uring_queue_init_params(epochfs.backing_uring_depth,
+					&epochfs.uring, &params);
+	if (rc < 0) {
+		fuse_log(FUSE_LOG_WARNING,
+			 "epochfs: io_uring unavailable, using syscalls: %s\n",
+			 strerror(-rc));
+		return;
+	}
+	rc = pthread_create(&epochfs.uring_thread, NULL,
+			    epochfs_uring_thread, NULL);
+	if (rc != 0) {
+		fuse_log(FUSE_LOG_WARNING,
+			 "epochfs: cannot start io_uring thread: %s\n",
+			 strerror(rc));
+		io_uring_queue_exit(&epochfs.uring);
+		return;
+	}
+	epochfs.uring_running = 1;
+	fuse_log(FUSE_LOG_INFO, "epochfs: backing io_uring depth=%u sqpoll=%d\n",
+		 epochfs.backing_uring_depth, epochfs.backing_uring_sqpoll);
+}
+
+static void
+epochfs_uring_stop(void)
+{
+	struct io_uring_sqe *sqe;
+
+	if (!epochfs.uring_running) {
+		return;
+	}
+
+	/*
+	 * 停止要求のNOPを投入し、完了スレッドが投入済みの要求を捌き切るのを
+	 * 待つ。SQが埋まっている場合は、完了スレッドが刈り取って空きが
+	 * できるまで投入を繰り返す。
+	 */
+	pthread_mutex_lock(&epochfs.uring_lock);
+	epochfs.uring_running = 0;
+	for (;;) {
+		sqe = io_uring_get_sqe(&epochfs.uring);
+		if (sqe != NULL) {
+			break;
+		}
+		io_uring_submit(&epochfs.uring);
+		pthread_mutex_unlock(&epochfs.uring_lock);
+		usleep(1000);
+		pthread_mutex_lock(&epochfs.uring_lock);
+	}
+	io_uring_prep_nop(sqe);
+	epochfs_uring_submit(sqe, NULL);
+	pthread_join(epochfs.uring_thread, NULL);
+	io_uring_queue_exit(&epochfs.uring);
+}
+#else
+static inline int
+epochfs_uring_open(fuse_req_t req, struct epochfs_inode *inode,
+		   struct fuse_file_info *fi)
+{
+	return -1;
+}
+
+static inline int
+epochfs_uring_read(fuse_req_t req, int fd, size_t count, off_t offset)
+{
+	return -1;
+}
+
+static inline int
+epochfs_uring_fsync(fuse_req_t req, int fd, int datasync)
+{
+	return -1;
+}
+
+static inline int
+epochfs_uring_getattr(fuse_req_t req, struct epochfs_inode *inode, int fd)
+{
+	return -1;
+}
+
+static void
+epochfs_uring_start(void)
+{
+	if (epochfs.backing_uring) {
+		fuse_log(FUSE_LOG_WARNING,
+			 "epochfs: built without liburing, "
+			 "backing_uring ignored\n");
+	}
+}
+
+static inline void
+epochfs_uring_stop(void)
+{
+}
+#endif
+
+
+/* ---------------------------------------------------------------------
+ * 定期同期
+ * --------------------------------------------------------------------- */
+
+static void
+epochfs_syncer_sync(void)
+{
+	if (syncfs(epochfs.syncer_fd) < 0) {
+		EPOCHFS_ERRNO_LOG(errno);
+		fuse_log(FUSE_LOG_ERR, "epochfs: syncfs: %s\n", strerror(errno));
+		__atomic_add_fetch(&epochfs.syncer_errors, 1, __ATOMIC_RELAXED);
+		return;
+	}
+	__atomic_add_fetch(&epochfs.syncer_syncs, 1, __ATOMIC_RELAXED);
+}
+
+// flush=periodicの場合、flush_interval秒ごとにバッキングFSをsyncfsする
+static void *
+epochfs_syncer_thread(void *arg)
+{
+	struct timespec ts;
+
+	pthread_mutex_lock(&epochfs.syncer_lock);
+	while (epochfs.syncer_running) {
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += epochfs.flush_interval;
+		pthread_cond_timedwait(&epochfs.syncer_cond,
+				       &epochfs.syncer_lock, &ts);
+		if (!epochfs.syncer_running) {
+			break;
+		}
+		pthread_mutex_unlock(&epochfs.syncer_lock);
+
+		epochfs_syncer_sync();
+
+		pthread_mutex_lock(&epochfs.syncer_lock);
+	}
+	pthread_mutex_unlock(&epochfs.syncer_lock);
+	return NULL;
+}
+
+static int
+epochfs_syncer_start(void)
+{
+	int rc;
+
+	if (epochfs.flush != EPOCHFS_FLUSH_PERIODIC) {
+		return 0;
+	}
+	if (epochfs.flush_interval == 0) {
+		epochfs.flush_interval = 1;
+	}
+	epochfs.syncer_fd = openat(epochfs.root.fd, ".",
+				   O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (epochfs.syncer_fd < 0) {
+		return -errno;
+	}
+	epochfs.syncer_running = 1;
+	rc = pthread_create(&epochfs.syncer_thread, NULL,
+			    epochfs_syncer_thread, NULL);
+	if (rc != 0) {
+		epochfs.syncer_running = 0;
+		close(epochfs.syncer_fd);
+		epochfs.syncer_fd = -1;
+		return -rc;
+	}
+	return 0;
+}
+
+// 停止時にも一度同期し、アンマウント前の書き込みを落とさない
+static void
+epochfs_syncer_stop(void)
+{
+	pthread_mutex_lock(&epochfs.syncer_lock);
+	if (!epochfs.syncer_running) {
+		pthread_mutex_unlock(&epochfs.syncer_lock);
+		return;
+	}
+	epochfs.syncer_running = 0;
+	pthread_cond_signal(&epochfs.syncer_cond);
+	pthread_mutex_unlock(&epochfs.syncer_lock);
+
+	pthread_join(epochfs.syncer_thread, NULL);
+	epochfs_syncer_sync();
+	close(epochfs.syncer_fd);
+	epochfs.syncer_fd = -1;
+}
+
+
+/* ---------------------------------------------------------------------
+ * fsyncのグループコミット
+ * --------------------------------------------------------------------- */
+
+/*
+ * fsync_windowを指定した場合、fsync要求をキューに積んでワーカースレッドを
+ * 返し、コミットスレッドがfsync_windowマイクロ秒の間(またはfsync_batch件
+ * 集まるまで)に届いた要求をまとめて同期する。同じバッキングFSの要求が
+ * 複数ある場合、fsync_syncfsを指定していればsyncfsを一度だけ発行し、
+ * そうでなければ要求ごとにfsync/fdatasyncする。backing_uringが動作中で
+ * あれば、後者はio_uringで並行に発行し、そうでなければfsync_threads個の
+ * 同期スレッドで並行に発行する。コミットスレッド自身はシステムコールを
+ * 発行しないため、同期中も次のバッチを集められる。結果は全ての要求へ返す。
+ */
+static void
+epochfs_gsync_reply(struct epochfs_gsync_waiter *w, int err)
+{
+	fuse_reply_err(w->req, err);
+	free(w);
+}
+
+// 同期スレッドへ渡す。wのnextにつながる要求も同じ結果で応答する
+static void
+epochfs_gsync_dispatch(struct epochfs_gsync_waiter *w, int syncfs)
+{
+	w->syncfs = syncfs;
+	w->wnext = NULL;
+	pthread_mutex_lock(&epochfs.gsync_lock);
+	*epochfs.gsync_work_tail = w;
+	epochfs.gsync_work_tail = &w->wnext;
+	pthread_cond_signal(&epochfs.gsync_work_cond);
+	pthread_mutex_unlock(&epochfs.gsync_lock);
+}
+
+static void
+epochfs_gsync_commit(struct epochfs_gsync_waiter *list)
+{
+	struct epochfs_gsync_waiter *group;
+	struct epochfs_gsync_waiter **pp;
+	struct epochfs_gsync_waiter *w;
+	unsigned int n;
+	dev_t dev;
+
+	while (list != NULL) {
+		// 先頭と同じバッキングFSの要求を抜き出す
+		dev = list->dev;
+		group = NULL;
+		n = 0;
+		for (pp = &list; (w = *pp) != NULL; ) {
+			if (w->dev == dev) {
+				*pp = w->next;
+				w->next = group;
+				group = w;
+				n++;
+			} else {
+				pp = &w->next;
+			}
+		}
+
+		if (epochfs.fsync_syncfs && n > 1) {
+			epochfs_gsync_dispatch(group, 1);
+			continue;
+		}
+
+		while ((w = group) != NULL) {
+			group = w->next;
+			w->next = NULL;
+			if (epochfs_uring_fsync(w->req, w->fd, w->datasync) == 0) {
+				__atomic_add_fetch(&epochfs.gsync_syscalls, 1,
+						   __ATOMIC_RELAXED);
+				free(w);
+				continue;
+			}
+			epochfs_gsync_dispatch(w, 0);
+		}
+	}
+}
+
+static void
+epochfs_gsync_sync(struct epochfs_gsync_waiter *w)
+{
+	struct epochfs_gsync_waiter *next;
+	int err;
+	int rc;
+
+	if (w->syncfs) {
+		rc = syncfs(w->fd);
+	} else {
+		rc = w->datasync ? fdatasync(w->fd) : fsync(w->fd);
+	}
+	err = rc < 0 ? errno : 0;
+	if (err != 0) {
+		EPOCHFS_ERRNO_LOG(err);
+	}
+	__atomic_add_fetch(&epochfs.gsync_syscalls, 1, __ATOMIC_RELAXED);
+	for (; w != NULL; w = next) {
+		next = w->next;
+		epochfs_gsync_reply(w, err);
+	}
+}
+
+// 同期スレッド
+static void *
+epochfs_gsync_worker(void *arg)
+{
+	struct epochfs_gsync_waiter *w;
+
+	pthread_mutex_lock(&epochfs.gsync_lock);
+	for (;;) {
+		while (epochfs.gsync_workers_running &&
+		       epochfs.gsync_work_head == NULL) {
+			pthread_cond_wait(&epochfs.gsync_work_cond,
+					  &epochfs.gsync_lock);
+		}
+		w = epochfs.gsync_work_head;
+		if (w == NULL) {
+			break;
+		}
+		epochfs.gsync_work_head = w->wnext;
+		if (epochfs.gsync_work_head == NULL) {
+			epochfs.gsync_work_tail = &epochfs.gsync_work_head;
+		}
+		pthread_mutex_unlock(&epochfs.gsync_lock);
+
+		epochfs_gsync_sync(w);
+
+		pthread_mutex_lock(&epochfs.gsync_lock);
+	}
+	pthread_mutex_unlock(&epochfs.gsync_lock);
+	return NULL;
+}
+
+static void *
+epochfs_gsync_thread(void *arg)
+{
+	struct epochfs_gsync_waiter *list;
+	struct timespec deadline;
+
+	pthread_mutex_lock(&epochfs.gsync_lock);
+	for (;;) {
+		while (epochfs.gsync_running && epochfs.gsync_head == NULL) {
+			pthread_cond_wait(&epochfs.gsync_cond,
+					  &epochfs.gsync_lock);
+		}
+		if (epochfs.gsync_head == NULL) {
+			break;
+		}
+
+		// 最初の要求からfsync_windowの間、後続の要求を待つ
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_nsec += (long)epochfs.fsync_window * 1000;
+		deadline.tv_sec += deadline.tv_nsec / 1000000000;
+		deadline.tv_nsec %= 1000000000;
+		while (epochfs.gsync_running &&
+		       epochfs.gsync_count < epochfs.fsync_batch) {
+			if (pthread_cond_timedwait(&epochfs.gsync_cond,
+						   &epochfs.gsync_lock,
+						   &deadline) == ETIMEDOUT) {
+				break;
+			}
+		}
+
+		list = epochfs.gsync_head;
+		epochfs.gsync_head = NULL;
+		epochfs.gsync_tail = &epochfs.gsync_head;
+		epochfs.gsync_count = 0;
+		epochfs.gsync_batches++;
+		pthread_mutex_unlock(&epochfs.gsync_lock);
+
+		epochfs_gsync_commit(list);
+
+		pthread_mutex_lock(&epochfs.gsync_lock);
+	}
+	pthread_mutex_unlock(&epochfs.gsync_lock);
+	return NULL;
+}
+
+// キューに積んだ場合は0を返し、応答はコミットスレッドが行う
+static int
+epochfs_gsync_queue(fuse_req_t req, struct epochfs_inode *inode, int fd,
+		    int datasync)
+{
+	struct epochfs_gsync_waiter *w;
+
+	if (!epochfs.gsync_running) {
+		return -1;
+	}
+	w = malloc(sizeof(*w));
+	if (w == NULL) {
+		return -1;
+	}
+	w->next = NULL;
+	w->req = req;
+	w->fd = fd;
+	w->datasync = datasync;
+	w->dev = inode->dev;
+
+	pthread_mutex_lock(&epochfs.gsync_lock);
+	if (!epochfs.gsync_running) {
+		pthread_mutex_unlock(&epochfs.gsync_lock);
+		free(w);
+		return -1;
+	}
+	*epochfs.gsync_tail = w;
+	epochfs.gsync_tail = &w->next;
+	epochfs.gsync_count++;
+	epochfs.gsync_requests++;
+	if (epochfs.gsync_count == 1 ||
+	    epochfs.gsync_count >= epochfs.fsync_batch) {
+		pthread_cond_signal(&epochfs.gsync_cond);
+	}
+	pthread_mutex_unlock(&epochfs.gsync_lock);
+	return 0;
+}
+
+static void epochfs_gsync_stop(void);
+
+static int
+epochfs_gsync_start(void)
+{
+	unsigned int i;
+	int rc;
+
+	if (epochfs.fsync_window == 0) {
+		return 0;
+	}
+	if (epochfs.fsync_batch == 0) {
+		epochfs.fsync_batch = 1;
+	}
+	if (epochfs.fsync_threads == 0) {
+		epochfs.fsync_threads = 1;
+	}
+	epochfs.gsync_workers = calloc(epochfs.fsync_threads,
+				       sizeof(pthread_t));
+	if (epochfs.gsync_workers == NULL) {
+		return -ENOMEM;
+	}
+	epochfs.gsync_tail = &epochfs.gsync_head;
+	epochfs.gsync_work_tail = &epochfs.gsync_work_head;
+
+	epochfs.gsync_workers_running = 1;
+	for (i = 0; i < epochfs.fsync_threads; i++) {
+		rc = pthread_create(&epochfs.gsync_workers[i], NULL,
+				    epochfs_gsync_worker, NULL);
+		if (rc != 0) {
+			epochfs_gsync_stop();
+			return -rc;
+		}
+		epochfs.gsync_nworkers++;
+	}
+
+	epochfs.gsync_running = 1;
+	rc = pthread_create(&epochfs.gsync_thread, NULL,
+			    epochfs_gsync_thread, NULL);
+	if (rc != 0) {
+		epochfs.gsync_running = 0;
+		epochfs_gsync_stop();
+		return -rc;
+	}
+	return 0;
+}
+
+// キューに残った要求は同期してから終了する
+static void
+epochfs_gsync_stop(void)
+{
+	unsigned int i;
+
+	pthread_mutex_lock(&epochfs.gsync_lock);
+	if (epochfs.gsync_running) {
+		epochfs.gsync_running = 0;
+		pthread_cond_signal(&epochfs.gsync_cond);
+		pthread_mutex_unlock(&epochfs.gsync_lock);
+		pthread_join(epochfs.gsync_thread, NULL);
+		pthread_mutex_lock(&epochfs.gsync_lock);
+	}
+	if (!epochfs.gsync_workers_running) {
+		pthread_mutex_unlock(&epochfs.gsync_lock);
+		return;
+	}
+	// コミットスレッドが渡した要求を処理し終えてから同期スレッドを止める
+	epochfs.gsync_workers_running = 0;
+	pthread_cond_broadcast(&epochfs.gsync_work_cond);
+	pthread_mutex_unlock(&epochfs.gsync_lock);
+
+	for (i = 0; i < epochfs.gsync_nworkers; i++) {
+		pthread_join(epochfs.gsync_workers[i], NULL);
+	}
+	epochfs.gsync_nworkers = 0;
+	free(epochfs.gsync_workers);
+	epochfs.gsync_workers = NULL;
+}
+
+
+/* ---------------------------------------------------------------------
+ * 非同期close
+ * --------------------------------------------------------------------- */
+
+/*
+ * async_releaseを指定した場合、releaseはバッキングfdをキューに積んで
+ * 即座に応答し、closeスレッドがcloseする。NFS等ではcloseがサーバへの
+ * 書き戻しを伴うため、アプリケーションのcloseを待たせずに済む。
+ * キューが満杯の場合はreleaseが空きを待つ。closeのエラーは応答できない
+ * ため、ログと統計情報で報告する。
+ */
+static void *
+epochfs_closer_thread(void *arg)
+{
+	int fd;
+
+	pthread_mutex_lock(&epochfs.closer_lock);
+	for (;;) {
+		while (epochfs.closer_running && epochfs.closer_count == 0) {
+			pthread_cond_wait(&epochfs.closer_nonempty,
+					  &epochfs.closer_lock);
+		}
+		if (epochfs.closer_count == 0) {
+			break;
+		}
+		fd = epochfs.closer_q[epochfs.closer_head];
+		epochfs.closer_head = (epochfs.closer_head + 1) %
+				      epochfs.release_queue;
+		epochfs.closer_count--;
+		pthread_cond_signal(&epochfs.closer_nonfull);
+		pthread_mutex_unlock(&epochfs.closer_lock);
+
+		if (close(fd) < 0) {
+			EPOCHFS_ERRNO_LOG(errno);
+			fuse_log(FUSE_LOG_ERR, "epochfs: close fd=%d: %s\n",
+				 fd, strerror(errno));
+			__atomic_add_fetch(&epochfs.closer_errors, 1,
+					   __ATOMIC_RELAXED);
+		}
+		__atomic_add_fetch(&epochfs.closer_closes, 1, __ATOMIC_RELAXED);
+
+		pthread_mutex_lock(&epochfs.closer_lock);
+	}
+	pthread_mutex_unlock(&epochfs.closer_lock);
+	return NULL;
+}
+
+// キューに積んだ場合は0を返す
+static int
+epochfs_closer_queue(int fd)
+{
+	pthread_mutex_lock(&epochfs.closer_lock);
+	if (epochfs.closer_running &&
+	    epochfs.closer_count == epochfs.release_queue) {
+		epochfs.closer_waits++;
+		while (epochfs.closer_running &&
+		       epochfs.closer_count == epochfs.release_queue) {
+			pthread_cond_wait(&epochfs.closer_nonfull,
+					  &epochfs.closer_lock);
+		}
+	}
+	if (!epochfs.closer_running) {
+		pthread_mutex_unlock(&epochfs.closer_lock);
+		return -1;
+	}
+	epochfs.closer_q[(epochfs.closer_head + epochfs.closer_count) %
+			 epochfs.release_queue] = fd;
+	epochfs.closer_count++;
+	pthread_cond_signal(&epochfs.closer_nonempty);
+	pthread_mutex_unlock(&epochfs.closer_lock);
+	return 0;
+}
+
+static void epochfs_closer_stop(void);
+
+static int
+epochfs_closer_start(void)
+{
+	unsigned int i;
+	int rc;
+
+	if (!epochfs.async_release) {
+		return 0;
+	}
+	if (epochfs.release_threads == 0) {
+		epochfs.release_threads = 1;
+	}
+	if (epochfs.release_queue == 0) {
+		epochfs.release_queue = 1;
+	}
+	epochfs.closer_q = calloc(epochfs.release_queue, sizeof(int));
+	epochfs.closer_threads = calloc(epochfs.release_threads,
+					sizeof(pthread_t));
+	if (epochfs.closer_q == NULL || epochfs.closer_threads == NULL) {
+		free(epochfs.closer_q);
+		free(epochfs.closer_threads);
+		epochfs.closer_q = NULL;
+		epochfs.closer_threads = NULL;
+		return -ENOMEM;
+	}
+
+	epochfs.closer_running = 1;
+	for (i = 0; i < epochfs.release_threads; i++) {
+		rc = pthread_create(&epochfs.closer_threads[i], NULL,
+				    epochfs_closer_thread, NULL);
+		if (rc != 0) {
+			epochfs_closer_stop();
+			return -rc;
+		}
+		epochfs.closer_nthreads++;
+	}
+	return 0;
+}
+
+// キューに残ったfdをすべてcloseしてから終了する
+static void
+epochfs_closer_stop(void)
+{
+	unsigned int i;
+
+	pthread_mutex_lock(&epochfs.closer_lock);
+	if (!epochfs.closer_running) {
+		pthread_mutex_unlock(&epochfs.closer_lock);
+		return;
+	}
+	epochfs.closer_running = 0;
+	pthread_cond_broadcast(&epochfs.closer_nonempty);
+	pthread_cond_broadcast(&epochfs.closer_nonfull);
+	pthread_mutex_unlock(&epochfs.closer_lock);
+
+	for (i = 0; i < epochfs.closer_nthreads; i++) {
+		pthread_join(epochfs.closer_threads[i], NULL);
+	}
+	epochfs.closer_nthreads = 0;
+	free(epochfs.closer_threads);
+	free(epochfs.closer_q);
+	epochfs.closer_threads = NULL;
+	epochfs.closer_q = NULL;
+}
+
+
+/* ---------------------------------------------------------------------
+ * 遅延削除
+ * --------------------------------------------------------------------- */
+
+/*
+ * trash_thresholdを指定した場合、unlinkされたその大きさ以上のファイルを
+ * base_path直下のゴミ箱へrenameして即座に応答する。削除スレッドが
+ * EPOCHFS_TRASH_STEPずつ切り詰めてからunlinkするため、エクステントの
+ * 多い巨大なファイルでもFUSEワーカーを長時間止めない。
+ * 開いたままのファイルを切り詰めないよう、inodeテーブルに残っている
+ * (カーネルがforgetしていない)ファイルは後回しにする。
+ * ゴミ箱に残ったファイルは次回起動時に削除を再開する。
+ */
+static void
+epochfs_trash_add(const char *name, const struct stat *st)
+{
+	struct epochfs_trash_ent *ent;
+
+	ent = calloc(1, sizeof(*ent));
+	if (ent == NULL) {
+		return;
+	}
+	snprintf(ent->name, sizeof(ent->name), "%s", name);
+	ent->dev = st->st_dev;
+	ent->ino = st->st_ino;
+	ent->bytes = (uint64_t)st->st_blocks * 512;
+
+	pthread_mutex_lock(&epochfs.trash_lock);
+	ent->next = epochfs.trash_list;
+	epochfs.trash_list = ent;
+	epochfs.trash_pending += ent->bytes;
+	epochfs.trash_files++;
+	pthread_cond_signal(&epochfs.trash_cond);
+	pthread_mutex_unlock(&epochfs.trash_lock);
+}
+
+// ゴミ箱へ移動した場合は0を返す。負の値の場合は呼び出し元がunlinkする。
+static int
+epochfs_trash_unlink(struct epochfs_inode *dir, const char *name)
+{
+	struct stat st;
+	char tname[EPOCHFS_TRASH_NAMELEN];
+
+	if (epochfs.trash_fd < 0) {
+		return -1;
+	}
+	if (fstatat(dir->fd, name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+		return -1;
+	}
+	// 他にリンクがあればunlinkしても解放は起きない
+	if (!S_ISREG(st.st_mode) || st.st_nlink != 1 ||
+	    (unsigned long long)st.st_size < epochfs.trash_threshold) {
+		return -1;
+	}
+
+	snprintf(tname, sizeof(tname), "%llx.%llx",
+		 (unsigned long long)st.st_ino,
+		 (unsigned long long)epochfs_now_ns());
+	// 別のFSがbase_path配下にマウントされている場合はEXDEVとなる
+	if (renameat2(dir->fd, name, epochfs.trash_fd, tname,
+		      RENAME_NOREPLACE) < 0) {
+		EPOCHFS_ERRNO_LOG(errno);
+		return -1;
+	}
+	epochfs_acache_inval(st.st_dev, st.st_ino);
+	epochfs_trash_add(tname, &st);
+	return 0;
+}
+
+// entを切り詰めて削除する。停止要求があれば途中で戻る。
+static void
+epochfs_trash_delete(struct epochfs_trash_ent *ent)
+{
+	struct stat st;
+	uint64_t freed;
+	off_t size;
+	int fd;
+
+	fd = openat(epochfs.trash_fd, ent->name, O_WRONLY | O_NOFOLLOW);
+	if (fd >= 0 && fstat(fd, &st) == 0) {
+		for (size = st.st_size; size > 0 && epochfs.trash_running; ) {
+			size = (uint64_t)size > EPOCHFS_TRASH_STEP ?
+			       size - EPOCHFS_TRASH_STEP : 0;
+			if (ftruncate(fd, size) < 0) {
+				EPOCHFS_ERRNO_LOG(errno);
+				break;
+			}
+			if (fstat(fd, &st) == 0) {
+				freed = (uint64_t)st.st_blocks * 512;
+				freed = ent->bytes > freed ? ent->bytes - freed : 0;
+				pthread_mutex_lock(&epochfs.trash_lock);
+				epochfs.trash_pending -= freed;
+				ent->bytes -= freed;
+				pthread_mutex_unlock(&epochfs.trash_lock);
+			}
+		}
+		if (size > 0) {
+			close(fd);
+			return;
+		}
+	}
+	if (fd >= 0) {
+		close(fd);
+	}
+	if (unlinkat(epochfs.trash_fd, ent->name, 0) < 0 && errno != ENOENT) {
+		EPOCHFS_ERRNO_LOG(errno);
+		return;
+	}
+
+	pthread_mutex_lock(&epochfs.trash_lock);
+	epochfs.trash_pending -= ent->bytes;
+	ent->bytes = 0;
+	ent->ino = 0;			// 削除済みの印
+	epochfs.trash_files--;
+	epochfs.trash_deleted++;
+	pthread_mutex_unlock(&epochfs.trash_lock);
+}
+
+static void *
+epochfs_trash_thread(void *arg)
+{
+	struct epochfs_trash_ent **pp;
+	struct epochfs_trash_ent *ent;
+	struct timespec ts;
+	uint64_t now;
+
+	pthread_mutex_lock(&epochfs.trash_lock);
+	while (epochfs.trash_running) {
+		now = epochfs_now_ns();
+		for (pp = &epochfs.trash_list; (ent = *pp) != NULL;
+		     pp = &ent->next) {
+			if (ent->retry <= now &&
+			    epochfs_itable_find(ent->dev, ent->ino) == NULL) {
+				break;
+			}
+		}
+		if (ent == NULL) {
+			// 全て使用中か空であれば、forgetを待って再確認する
+			clock_gettime(CLOCK_REALTIME, &ts);
+			ts.tv_sec += 1;
+			pthread_cond_timedwait(&epochfs.trash_cond,
+					       &epochfs.trash_lock, &ts);
+			continue;
+		}
+		pthread_mutex_unlock(&epochfs.trash_lock);
+
+		epochfs_trash_delete(ent);
+
+		pthread_mutex_lock(&epochfs.trash_lock);
+		if (ent->ino == 0) {
+			for (pp = &epochfs.trash_list; *pp != ent;
+			     pp = &(*pp)->next) {
+			}
+			*pp = ent->next;
+			free(ent);
+		} else {
+			ent->retry = epochfs_now_ns() + EPOCHFS_TRASH_RETRY;
+		}
+	}
+	pthread_mutex_unlock(&epochfs.trash_lock);
+	return NULL;
+}
+
+// ゴミ箱を作成し、前回の残りを削除待ちに登録する
+static int
+epochfs_trash_init(void)
+{
+	struct dirent *dent;
+	struct stat st;
+	DIR *dp;
+	int fd;
+
+	if (epochfs.trash_threshold == 0) {
+		return 0;
+	}
+	if (mkdirat(epochfs.root.fd, EPOCHFS_TRASH_NAME, 0700) < 0 &&
+	    errno != EEXIST) {
+		return -errno;
+	}
+	epochfs.trash_fd = openat(epochfs.root.fd, EPOCHFS_TRASH_NAME,
+				  O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+	if (epochfs.trash_fd < 0) {
+		return -errno;
+	}
+
+	fd = dup(epochfs.trash_fd);
+	dp = fd < 0 ? NULL : fdopendir(fd);
+	if (dp == NULL) {
+		if (fd >= 0) {
+			close(fd);
+		}
+		return 0;
+	}
+	while ((dent = readdir(dp)) != NULL) {
+		if (epochfs_is_dot_or_dotdot(dent->d_name) ||
+		    strlen(dent->d_name) >= EPOCHFS_TRASH_NAMELEN) {
+			continue;
+		}
+		if (fstatat(epochfs.trash_fd, dent->d_name, &st,
+			    AT_SYMLINK_NOFOLLOW) == 0) {
+			epochfs_trash_add(dent->d_name, &st);
+		}
+	}
+	closedir(dp);
+	return 0;
+}
+
+static int
+epochfs_trash_start(void)
+{
+	int rc;
+
+	if (epochfs.trash_fd < 0) {
+		return 0;
+	}
+	epochfs.trash_running = 1;
+	rc = pthread_create(&epochfs.trash_thread, NULL,
+			    epochfs_trash_thread, NULL);
+	if (rc != 0) {
+		epochfs.trash_running = 0;
+		return -rc;
+	}
+	return 0;
+}
+
+// 削除し切れなかったファイルはゴミ箱に残し、次回起動時に削除する
+static void
+epochfs_trash_stop(void)
+{
+	struct epochfs_trash_ent *ent;
+
+	pthread_mutex_lock(&epochfs.trash_lock);
+	if (epochfs.trash_running) {
+		epochfs.trash_running = 0;
+		pthread_cond_signal(&epochfs.trash_cond);
+		pthread_mutex_unlock(&epochfs.trash_lock);
+		pthread_join(epochfs.trash_thread, NULL);
+	} else {
+		pthread_mutex_unlock(&epochfs.trash_lock);
+	}
+
+	while ((ent = epochfs.trash_list) != NULL) {
+		epochfs.trash_list = ent->next;
+		free(ent);
+	}
+	if (epochfs.trash_fd >= 0) {
+		close(epochfs.trash_fd);
+		epochfs.trash_fd = -1;
+	}
+}
+
+
+/* ---------------------------------------------------------------------
+ * filesystem操作
+ * --------------------------------------------------------------------- */
+/*
+ * statfs_cache_ttlを指定した場合、base_pathのFSの結果をその間キャッシュし、
+ * dfを頻繁に実行する監視エージェント等からの問い合わせをバッキングFSへ
+ * 流さない。statfs_cache_bytesを指定した場合は、その量を書き込んだ時点で
+ * 期限前でも取り直す。base_path配下にマウントされた別のFSは毎回問い合わせる。
+ */
+static int
+epochfs_statfs_cached(struct epochfs_inode *inode, struct statvfs *buf)
+{
+	uint64_t now;
+	int rc;
+
+	if (epochfs.statfs_cache_ttl <= 0 || inode->dev != epochfs.root.dev) {
+		return fstatvfs(inode->fd, buf) < 0 ? -errno : 0;
+	}
+
+	now = epochfs_now_ns();
+	pthread_mutex_lock(&epochfs.statfs_lock);
+	if (epochfs.statfs_expire > now &&
+	    (epochfs.statfs_cache_bytes == 0 ||
+	     __atomic_load_n(&epochfs.statfs_written, __ATOMIC_RELAXED) <
+	     epochfs.statfs_cache_bytes)) {
+		*buf = epochfs.statfs_buf;
+		epochfs.statfs_hits++;
+		pthread_mutex_unlock(&epochfs.statfs_lock);
+		return 0;
+	}
+	epochfs.statfs_misses++;
+	__atomic_store_n(&epochfs.statfs_written, 0, __ATOMIC_RELAXED);
+	rc = fstatvfs(epochfs.root.fd, buf);
+	if (rc < 0) {
+		rc = -errno;
+		epochfs.statfs_expire = 0;
+	} else {
+		epochfs.statfs_buf = *buf;
+		epochfs.statfs_expire = now +
+			(uint64_t)(epochfs.statfs_cache_ttl * 1000000000.0);
+	}
+	pthread_mutex_unlock(&epochfs.statfs_lock);
+	return rc;
+}
+
+static void
+epochfs_statfs(fuse_req_t req, fuse_ino_t ino)
+{
+	int rc;
+	struct statvfs buf;
+	uint64_t pending;
+	struct epochfs_inode *inode = epochfs_inode(ino);
+
+	EPOCHFS_DEBUG_LOG("ino=%lu", ino);
+
+	rc = epochfs_statfs_cached(inode, &buf);
+	if (rc < 0) {
+		EPOCHFS_ERRNO_LOG(-rc);
+		fuse_reply_err(req, -rc);
+		return;
+	}
+
+	// 遅延削除待ちの領域は空きとして見せる
+	if (epochfs.trash_fd >= 0 && inode->dev == epochfs.root.dev &&
+	    buf.f_frsize != 0) {
+		pthread_mutex_lock(&epochfs.trash_lock);
+		pending = epochfs.trash_pending / buf.f_frsize;
+		pthread_mutex_unlock(&epochfs.trash_lock);
+		buf.f_bfree += pending;
+		buf.f_bavail += pending;
+	}
+	fuse_reply_statfs(req, &buf);
+}
+
+/* ---------------------------------------------------------------------
+ * inode操作
+ * --------------------------------------------------------------------- */
+
+/*
+ * default_permissionsではカーネルが要求元の資格情報とgetattrの属性で
+ * 権限を判定する。rootで動作している場合、作成したエントリはrootの
+ * 所有となってしまうため、要求元のuid/gidへ変更する。setgidされた
+ * ディレクトリ配下ではバッキングFSが継承したgidをそのまま使う。
+ * 一般ユーザーで動作している場合はバッキングFS側でもデーモンの
+ * 権限で判定されるため、所有者は変更しない。
+ *
+ * rootによるchownは通常ファイルのsetuid/setgidビットを落とすうえ、
+ * ビット付きで作成すると一瞬rootのsetuidファイルが存在してしまう。
+ * そのため作成時はepochfs_create_mode()でビットを外し、chown後に
+ * 付け直す。setgidビットは要求元のgidと一致する場合のみ残す。
+ * (setfsuidで要求元として作成すると補助グループが反映されない)
+ */
+static inline mode_t
+epochfs_create_mode(mode_t mode)
+{
+	if (!epochfs.default_permissions || !epochfs.as_root) {
+		return mode;
+	}
+	return mode & ~(S_ISUID | S_ISGID);
+}
+
+static void
+epochfs_set_owner(fuse_req_t req, struct epochfs_inode *dir, const char *name,
+		  mode_t mode)
+{
+	const struct fuse_ctx *ctx;
+	struct stat st;
+	gid_t gid;
+
+	if (!epochfs.default_permissions || !epochfs.as_root) {
+		return;
+	}
+
+	ctx = fuse_req_ctx(req);
+	gid = ctx->gid;
+	if (fstatat(dir->fd, "", &st, AT_EMPTY_PATH) == 0 &&
+	    (st.st_mode & S_ISGID)) {
+		gid = (gid_t)-1;
+	}
+	if (fchownat(dir->fd, name, ctx->uid, gid, AT_SYMLINK_NOFOLLOW) < 0) {
+		EPOCHFS_ERRNO_LOG(errno);
+		return;
+	}
+
+	if (!S_ISREG(mode) || !(mode & (S_ISUID | S_ISGID)) ||
+	    fstatat(dir->fd, name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+		return;
+	}
+	mode &= S_ISUID | (st.st_gid == ctx->gid ? S_ISGID : 0);
+	if (mode != 0 &&
+	    fchmodat(dir->fd, name, (st.st_mode & 07777) | mode, 0) < 0) {
+		EPOCHFS_ERRNO_LOG(errno);
+	}
+}
+static void
+epochfs_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	struct fuse_entry_param e;
+	struct epochfs_inode *dir = epochfs_inode(parent);
+	uint64_t gen;
+	int rc;
+
+	EPOCHFS_DEBUG_LOG("parent=%lu name=%s", parent, name);
+
+	/*
+	 * 存在しない名前はino=0で応答し、カーネルにもnegative_timeoutの間
+	 * 負のエントリとしてキャッシュさせる。
+	 */
+	memset(&e, 0, sizeof(e));
+	e.entry_timeout = epochfs.negative_timeout;
+	if (epochfs_dcache_negative(dir, name)) {
+		fuse_reply_entry(req, &e);
+		return;
+	}
+
+	gen = epochfs_dcache_gen();
+	rc = epochfs_do_lookup(parent, name, &e);
+	if (rc == -ENOENT && epochfs.negative_timeout > 0) {
+		epochfs_dcache_add_negative(dir, name, gen);
+		memset(&e, 0, sizeof(e));
+		e.entry_timeout = epochfs.negative_timeout;
+		fuse_reply_entry(req, &e);
+		return;
+	}
+	if (rc < 0) {
+		fuse_reply_err(req, -rc);
+		return;
+	}
+	fuse_reply_entry(req, &e);
+}
+
+static void
+epochfs_forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup)
+{
+	EPOCHFS_DEBUG_LOG("ino=%lu nlookup=%lu", ino, nlookup);
+
+	epochfs_inode_put(epochfs_inode(ino), nlookup);
+	fuse_reply_none(req);
+}
+
+static void
+epochfs_forget_multi(fuse_req_t req, size_t count,
+		     struct fuse_forget_data *forgets)
+{
+	size_t i;
+
+	EPOCHFS_DEBUG_LOG("count=%ld", count);
+
+	for (i = 0; i < count; i++) {
+		epochfs_inode_put(epochfs_inode(forgets[i].ino),
+				  forgets[i].nlookup);
+	}
+	fuse_reply_none(req);
+}
+
+static void
+epochfs_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	int rc;
+	struct stat buf;
+	uint64_t gen;
+	struct epochfs_inode *inode = epochfs_inode(ino);
+
+	EPOCHFS_DEBUG_LOG("ino=%lu fi=%p", ino, fi);
+
+	/*
+	 * パススルーで書き込み中のファイルは、カーネルがデーモンを経由せず
+	 * 書き込むため無効化の契機がない。属性キャッシュを使わずにstatする。
+	 */
+	if (!epochfs_passthrough_writing(inode) &&
+	    epochfs_acache_get(inode->dev, inode->ino, &buf)) {
+		epochfs_stat_map_ino(&buf);
+		fuse_reply_attr(req, &buf, epochfs.attr_timeout);
+		return;
+	}
+
+	if (epochfs_uring_getattr(req, inode, fi != NULL ?
+				  (int)fi->fh : inode->fd) == 0) {
+		return;
+	}
+
+	gen = epochfs_acache_gen();
+	rc = epochfs_stat_fd(fi != NULL ? (int)fi->fh : inode->fd, &buf);
+	if (rc < 0) {
+		fuse_reply_err(req, errno);
+		return;
+	}
+
+	epochfs_stat_unix2local(&buf);
+	if (!epochfs_passthrough_writing(inode)) {
+		epochfs_acache_put(&buf, gen);
+	}
+	epochfs_stat_map_ino(&buf);
+	fuse_reply_attr(req, &buf, epochfs.attr_timeout);
+}
+
+/*
+ * statx(2)を直接受け付ける。作成時刻(btime)もepoch時間をずらして返す。
+ * btimeを要求されない場合は属性キャッシュから応答する。
+ */
+#if FUSE_VERSION >= FUSE_MAKE_VERSION(3, 18)
+static void
+epochfs_statx(fuse_req_t req, fuse_ino_t ino, int flags, int mask,
+	      struct fuse_file_info *fi)
+{
+	int rc;
+	struct stat buf;
+	struct statx stx;
+	struct epochfs_inode *inode = epochfs_inode(ino);
+
+	EPOCHFS_DEBUG_LOG("ino=%lu flags=0x%x mask=0x%x", ino, flags, mask);
+
+	if (!(mask & STATX_BTIME) && !epochfs_passthrough_writing(inode) &&
+	    epochfs_acache_get(inode->dev, inode->ino, &buf)) {
+		epochfs_stat_map_ino(&buf);
+		epochfs_stat_to_statx(&buf, &stx);
+		fuse_reply_statx(req, 0, &stx, epochfs.attr_timeout);
+		return;
+	}
+
+	// 呼び出し元の同期指定はstatx_dont_syncを指定していない場合のみ従う
+	flags &= AT_STATX_SYNC_TYPE;
+	if (epochfs.statx_dont_sync) {
+		flags = AT_STATX_DONT_SYNC;
+	}
+	rc = statx(fi != NULL ? (int)fi->fh : inode->fd, "",
+		   AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW | flags,
+		   STATX_BASIC_STATS | STATX_BTIME, &stx);
+	if (rc < 0) {
+		EPOCHFS_ERRNO_LOG(errno);
+		fuse_reply_err(req, errno);
+		return;
+	}
+
+	epochfs_statx_unix2local(&stx);
+	stx.stx_ino = epochfs_map_ino(makedev(stx.stx_dev_major,
+					      stx.stx_dev_minor), stx.stx_ino);
+	fuse_reply_statx(req, 0, &stx, epochfs.attr_timeout);
+}
+#endif
+
 static int
-epochfs_listxattr(const char *path, char *list, size_t size)
+epochfs_do_utimens(struct epochfs_inode *inode, struct stat *attr,
+		   int to_set, struct fuse_file_info *fi)
+{
+	struct timespec tv[2];
+	char procpath[PATH_MAX];
+
+	tv[0].tv_nsec = UTIME_OMIT;
+	tv[1].tv_nsec = UTIME_OMIT;
+
+	if (to_set & FUSE_SET_ATTR_ATIME_NOW) {
+		tv[0].tv_nsec = UTIME_NOW;
+	} else if (to_set & FUSE_SET_ATTR_ATIME) {
+		tv[0] = attr->st_atim;
+		tv[0].tv_sec = epochfs_epoch_local2unix(tv[0].tv_sec);
+	}
+	if (to_set & FUSE_SET_ATTR_MTIME_NOW) {
+		tv[1].tv_nsec = UTIME_NOW;
+	} else if (to_set & FUSE_SET_ATTR_MTIME) {
+		tv[1] = attr->st_mtim;
+		tv[1].tv_sec = epochfs_epoch_local2unix(tv[1].tv_sec);
+	}
+
+	if (fi != NULL) {
+		return futimens((int)fi->fh, tv);
+	}
+	epochfs_mkprocpath(inode, procpath);
+	return utimensat(AT_FDCWD, procpath, tv, 0);
+}
+
+static void
+epochfs_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
+		int to_set, struct fuse_file_info *fi)
+{
+	int rc;
+	struct epochfs_inode *inode = epochfs_inode(ino);
+	char procpath[PATH_MAX];
+	epochfs_mkprocpath(inode, procpath);
+
+	EPOCHFS_DEBUG_LOG("ino=%lu to_set=0x%08X", ino, to_set);
+
+	if (to_set & FUSE_SET_ATTR_MODE) {
+		if (fi != NULL) {
+			rc = fchmod((int)fi->fh, attr->st_mode);
+		} else {
+			rc = fchmodat(AT_FDCWD, procpath, attr->st_mode, 0);
+		}
+		if (rc < 0) {
+			goto err;
+		}
+	}
+	if (to_set & (FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID)) {
+		uid_t owner = (to_set & FUSE_SET_ATTR_UID) ?
+				attr->st_uid : (uid_t)-1;
+		gid_t group = (to_set & FUSE_SET_ATTR_GID) ?
+				attr->st_gid : (gid_t)-1;
+
+		rc = fchownat(inode->fd, "", owner, group,
+			      AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW);
+		if (rc < 0) {
+			goto err;
+		}
+	}
+	if (to_set & FUSE_SET_ATTR_SIZE) {
+		if (fi != NULL) {
+			rc = ftruncate((int)fi->fh, attr->st_size);
+		} else {
+			rc = truncate(procpath, attr->st_size);
+		}
+		if (rc < 0) {
+			goto err;
+		}
+	}
+	if (to_set & (FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME)) {
+		rc = epochfs_do_utimens(inode, attr, to_set, fi);
+		if (rc < 0) {
+			goto err;
+		}
+	}
+
+	epochfs_inode_inval(inode);
+	epochfs_getattr(req, ino, fi);
+	return;
+
+err:
+	EPOCHFS_ERRNO_LOG(errno);
+	rc = errno;
+	epochfs_inode_inval(inode);
+	fuse_reply_err(req, rc);
+}
+
+static void
+epochfs_symlink(fuse_req_t req, const char *target, fuse_ino_t parent,
+		const char *name)
+{
+	int rc;
+	struct epochfs_inode *dir = epochfs_inode(parent);
+
+	EPOCHFS_DEBUG_LOG("target=%s parent=%lu name=%s", target, parent, name);
+
+	if (epochfs_is_trash(dir, name)) {
+		fuse_reply_err(req, EPERM);
+		return;
+	}
+
+	rc = symlinkat(target, dir->fd, name);
+	if (rc < 0) {
+		EPOCHFS_ERRNO_LOG(errno);
+		fuse_reply_err(req, errno);
+		return;
+	}
+	epochfs_set_owner(req, dir, name, S_IFLNK);
+	epochfs_inode_inval(dir);
+	epochfs_dcache_inval(dir, name);
+	epochfs_reply_entry(req, parent, name);
+}
+
+/*
+ * シンボリックリンクの内容は変更できず、rename/unlink/symlinkでは別の
+ * inodeになるため、参照先はinodeを解放するまでキャッシュしてよい。
+ * O_PATHハンドルを保持している間はinode番号も再利用されない。
+ */
+static void
+epochfs_readlink(fuse_req_t req, fuse_ino_t ino)
+{
+	ssize_t rc;
+	char buf[PATH_MAX + 1];
+	char *link;
+	char *expected = NULL;
+	struct epochfs_inode *inode = epochfs_inode(ino);
+
+	EPOCHFS_DEBUG_LOG("ino=%lu", ino);
+
+	link = __atomic_load_n(&inode->link, __ATOMIC_ACQUIRE);
+	if (link != NULL) {
+		__atomic_add_fetch(&epochfs.link_hits, 1, __ATOMIC_RELAXED);
+		fuse_reply_readlink(req, link);
+		return;
+	}
+	__atomic_add_fetch(&epochfs.link_misses, 1, __ATOMIC_RELAXED);
+
+	rc = readlinkat(inode->fd, "", buf, sizeof(buf));
+	if (rc < 0) {
+		EPOCHFS_ERRNO_LOG(errno);
+		fuse_reply_err(req, errno);
+		return;
+	}
+	if (rc == sizeof(buf)) {
+		fuse_reply_err(req, ENAMETOOLONG);
+		return;
+	}
+	buf[rc] = '\0';
+
+	link = strdup(buf);
+	if (link != NULL &&
+	    !__atomic_compare_exchange_n(&inode->link, &expected, link, 0,
+					 __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+		free(link);
+	}
+	fuse_reply_readlink(req, buf);
+}
+
+static void
+epochfs_mknod(fuse_req_t req, fuse_ino_t parent, const char *name,
+	      mode_t mode, dev_t dev)
+{
+	int rc;
+	struct epochfs_inode *dir = epochfs_inode(parent);
+
+	EPOCHFS_DEBUG_LOG("parent=%lu name=%s", parent, name);
+
+	if (epochfs_is_trash(dir, name)) {
+		fuse_reply_err(req, EPERM);
+		return;
+	}
+
+	rc = mknodat(dir->fd, name, epochfs_create_mode(mode), dev);
+	if (rc < 0) {
+		EPOCHFS_ERRNO_LOG(errno);
+		fuse_reply_err(req, errno);
+		return;
+	}
+	epochfs_set_owner(req, dir, name, mode);
+	epochfs_inode_inval(dir);
+	epochfs_dcache_inval(dir, name);
+	epochfs_reply_entry(req, parent, name);
+}
+
+static void
+epochfs_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name,
+	      mode_t mode)
+{
+	int rc;
+	struct epochfs_inode *dir = epochfs_inode(parent);
+
+	EPOCHFS_DEBUG_LOG("parent=%lu name=%s", parent, name);
+
+	if (epochfs_is_trash(dir, name)) {
+		fuse_reply_err(req, EPERM);
+		return;
+	}
+
+	rc = mkdirat(dir->fd, name, mode);
+	if (rc < 0) {
+		EPOCHFS_ERRNO_LOG(errno);
+		fuse_reply_err(req, errno);
+		return;
+	}
+	epochfs_set_owner(req, dir, name, S_IFDIR | mode);
+	epochfs_inode_inval(dir);
+	epochfs_dcache_inval(dir, name);
+	epochfs_reply_entry(req, parent, name);
+}
+
+static void
+epochfs_unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	int rc;
+	int found;
+	struct stat st;
+	struct epochfs_inode *dir = epochfs_inode(parent);
+
+	EPOCHFS_DEBUG_LOG("parent=%lu name=%s", parent, name);
+
+	if (epochfs_is_trash(dir, name)) {
+		fuse_reply_err(req, ENOENT);
+		return;
+	}
+
+	// 削除するinodeは他のハードリンクから見えるため、st_nlinkを捨てる
+	found = (fstatat(dir->fd, name, &st, AT_SYMLINK_NOFOLLOW) == 0);
+	rc = epochfs_trash_unlink(dir, name);
+	if (rc < 0) {
+		rc = unlinkat(dir->fd, name, 0);
+	}
+	if (rc < 0) {
+		EPOCHFS_ERRNO_LOG(errno);
+		fuse_reply_err(req, errno);
+		return;
+	}
+	if (found) {
+		epochfs_acache_inval(st.st_dev, st.st_ino);
+	}
+	epochfs_inode_inval(dir);
+	epochfs_dcache_inval(dir, name);
+	fuse_reply_err(req, 0);
+}
+
+static void
+epochfs_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	int rc;
+	struct epochfs_inode *dir = epochfs_inode(parent);
+
+	EPOCHFS_DEBUG_LOG("parent=%lu name=%s", parent, name);
+
+	if (epochfs_is_trash(dir, name)) {
+		fuse_reply_err(req, ENOENT);
+		return;
+	}
+
+	rc = unlinkat(dir->fd, name, AT_REMOVEDIR);
+	if (rc < 0) {
+		EPOCHFS_ERRNO_LOG(errno);
+		fuse_reply_err(req, errno);
+		return;
+	}
+	epochfs_inode_inval(dir);
+	epochfs_dcache_inval(dir, name);
+	fuse_reply_err(req, 0);
+}
+
+
+static void
+epochfs_rename(fuse_req_t req, fuse_ino_t parent, const char *name,
+	       fuse_ino_t newparent, const char *newname, unsigned int flags)
+{
+	int rc;
+	int replaced;
+	struct stat st;
+	struct stat old;
+	struct epochfs_inode *olddir = epochfs_inode(parent);
+	struct epochfs_inode *newdir = epochfs_inode(newparent);
+
+	EPOCHFS_DEBUG_LOG("parent=%lu name=%s newparent=%lu newname=%s flags=%u",
+			  parent, name, newparent, newname, flags);
+
+	if (epochfs_is_trash(olddir, name)) {
+		fuse_reply_err(req, ENOENT);
+		return;
+	}
+	if (epochfs_is_trash(newdir, newname)) {
+		fuse_reply_err(req, EPERM);
+		return;
+	}
+
+	// 上書きされるinodeは他のハードリンクから見えるため、st_nlinkを捨てる
+	replaced = !(flags & (RENAME_NOREPLACE | RENAME_EXCHANGE)) &&
+		   fstatat(newdir->fd, newname, &old, AT_SYMLINK_NOFOLLOW) == 0;
+
+	// RENAME_NOREPLACE/RENAME_EXCHANGE もそのまま渡す
+	rc = renameat2(olddir->fd, name, newdir->fd, newname, flags);
+	if (rc < 0) {
+		EPOCHFS_ERRNO_LOG(errno);
+		fuse_reply_err(req, errno);
+		return;
+	}
+
+	// 移動したinodeはctimeが変わる
+	epochfs_inode_inval(olddir);
+	epochfs_inode_inval(newdir);
+	epochfs_dcache_inval(olddir, name);
+	epochfs_dcache_inval(newdir, newname);
+	if (replaced) {
+		epochfs_acache_inval(old.st_dev, old.st_ino);
+	}
+	if (fstatat(newdir->fd, newname, &st, AT_SYMLINK_NOFOLLOW) == 0) {
+		epochfs_acache_inval(st.st_dev, st.st_ino);
+	}
+	if ((flags & RENAME_EXCHANGE) &&
+	    fstatat(olddir->fd, name, &st, AT_SYMLINK_NOFOLLOW) == 0) {
+		epochfs_acache_inval(st.st_dev, st.st_ino);
+	}
+	fuse_reply_err(req, 0);
+}
+
+static void
+epochfs_link(fuse_req_t req, fuse_ino_t ino, fuse_ino_t newparent,
+	     const char *newname)
+{
+	int rc;
+	struct epochfs_inode *inode = epochfs_inode(ino);
+	struct epochfs_inode *newdir = epochfs_inode(newparent);
+	char procpath[PATH_MAX];
+
+	EPOCHFS_DEBUG_LOG("ino=%lu newparent=%lu newname=%s",
+			  ino, newparent, newname);
+
+	if (epochfs_is_trash(newdir, newname)) {
+		fuse_reply_err(req, EPERM);
+		return;
+	}
+
+	// AT_EMPTY_PATHはCAP_DAC_READ_SEARCHが必要。無い場合は/proc経由で行う
+	rc = linkat(inode->fd, "", newdir->fd, newname, AT_EMPTY_PATH);
+	if (rc < 0 && errno == ENOENT) {
+		epochfs_mkprocpath(inode, procpath);
+		rc = linkat(AT_FDCWD, procpath, newdir->fd, newname,
+			    AT_SYMLINK_FOLLOW);
+	}
+	if (rc < 0) {
+		EPOCHFS_ERRNO_LOG(errno);
+		fuse_reply_err(req, errno);
+		return;
+	}
+	epochfs_inode_inval(inode);
+	epochfs_inode_inval(newdir);
+	epochfs_dcache_inval(newdir, newname);
+	epochfs_reply_entry(req, newparent, newname);
+}
+
+static void
+epochfs_access(fuse_req_t req, fuse_ino_t ino, int mode)
+{
+	int rc;
+	char procpath[PATH_MAX];
+	epochfs_mkprocpath(epochfs_inode(ino), procpath);
+
+	EPOCHFS_DEBUG_LOG("ino=%lu mode=%d", ino, mode);
+
+	rc = access(procpath, mode);
+	if (rc < 0) {
+		EPOCHFS_ERRNO_LOG(errno);
+		fuse_reply_err(req, errno);
+		return;
+	}
+	fuse_reply_err(req, 0);
+}
+
+static void
+epochfs_setxattr(fuse_req_t req, fuse_ino_t ino, const char *name,
+		 const char *value, size_t size, int flags)
 {
 	int rc;
-	char fullpath[PATH_MAX];
-	epochfs_mkfullpath(path, fullpath);
+	char procpath[PATH_MAX];
+	epochfs_mkprocpath(epochfs_inode(ino), procpath);
+
+	EPOCHFS_DEBUG_LOG("ino=%lu name=%s size=%ld flags=%d",
+			  ino, name, size, flags);
+
+	if (!epochfs.security_xattr && strncmp(name, "security.", 9) == 0) {
+		fuse_reply_err(req, ENOTSUP);
+		return;
+	}
+
+	rc = setxattr(procpath, name, value, size, flags);
+	epochfs_xcache_drop(epochfs_inode(ino), name);
+	if (rc < 0) {
+		EPOCHFS_ERRNO_LOG(errno);
+		fuse_reply_err(req, errno);
+		return;
+	}
+	epochfs_inode_inval(epochfs_inode(ino));
+	fuse_reply_err(req, 0);
+}
+
+static void
+epochfs_getxattr(fuse_req_t req, fuse_ino_t ino, const char *name,
+		 size_t size)
+{
+	ssize_t rc;
+	char *value = NULL;
+	char procpath[PATH_MAX];
+	struct epochfs_inode *inode = epochfs_inode(ino);
+	uint64_t gen;
+
+	EPOCHFS_DEBUG_LOG("ino=%lu name=%s size=%ld", ino, name, size);
+
+	// security.*を使わないマウントでは問い合わせずに存在しないと応答する
+	if (!epochfs.security_xattr && strncmp(name, "security.", 9) == 0) {
+		fuse_reply_err(req, ENODATA);
+		return;
+	}
+
+	// size==0 の場合は必要なサイズのみ応答する
+	if (size != 0) {
+		value = malloc(size);
+		if (value == NULL) {
+			fuse_reply_err(req, ENOMEM);
+			return;
+		}
+	}
+
+	if (!epochfs_xcache_get(inode, name, value, size, &rc)) {
+		gen = epochfs_xcache_gen();
+		epochfs_mkprocpath(inode, procpath);
+		rc = getxattr(procpath, name, value, size);
+		if (rc < 0) {
+			rc = -errno;
+		}
+		// size==0では値が得られないため、負の結果のみ登録する
+		if (size != 0 || rc < 0) {
+			epochfs_xcache_put(inode, name, value, rc, gen);
+		}
+	}
+
+	if (rc < 0) {
+		EPOCHFS_ERRNO_LOG(-rc);
+		fuse_reply_err(req, -rc);
+	} else if (size == 0) {
+		fuse_reply_xattr(req, rc);
+	} else {
+		fuse_reply_buf(req, value, rc);
+	}
+	free(value);
+}
+
+// listからsecurity.*の名前を取り除き、残った長さを返す
+static ssize_t
+epochfs_listxattr_filter(char *list, ssize_t len)
+{
+	ssize_t in;
+	ssize_t out = 0;
+	size_t n;
+
+	for (in = 0; in < len; in += n) {
+		n = strnlen(list + in, len - in) + 1;
+		if (strncmp(list + in, "security.", 9) != 0) {
+			memmove(list + out, list + in, n);
+			out += n;
+		}
+	}
+	return out;
+}
+
+static void
+epochfs_listxattr(fuse_req_t req, fuse_ino_t ino, size_t size)
+{
+	ssize_t rc;
+	size_t len = size;
+	char *list = NULL;
+	char procpath[PATH_MAX];
+	epochfs_mkprocpath(epochfs_inode(ino), procpath);
+
+	EPOCHFS_DEBUG_LOG("ino=%lu size=%ld", ino, size);
+
+	/*
+	 * security.*を隠す場合は、取り除いた後の長さで応答するため
+	 * size==0でも一覧全体を取得する。
+	 */
+	if (!epochfs.security_xattr) {
+		rc = listxattr(procpath, NULL, 0);
+		if (rc < 0) {
+			EPOCHFS_ERRNO_LOG(errno);
+			fuse_reply_err(req, errno);
+			return;
+		}
+		len = rc;
+	}
 
-	EPOCHFS_DEBUG_LOG("path=%s list=%p size=%ld", path, list, size);
+	// size==0 の場合は必要なサイズのみ応答する
+	if (len != 0) {
+		list = malloc(len);
+		if (list == NULL) {
+			fuse_reply_err(req, ENOMEM);
+			return;
+		}
+	}
 
-	rc = llistxattr(fullpath, list, size);
+	rc = listxattr(procpath, list, len);
+	if (rc >= 0 && !epochfs.security_xattr) {
+		rc = epochfs_listxattr_filter(list, rc);
+		if (size != 0 && (size_t)rc > size) {
+			rc = -1;
+			errno = ERANGE;
+		}
+	}
 	if (rc < 0) {
 		EPOCHFS_ERRNO_LOG(errno);
-		return -errno;
+		fuse_reply_err(req, errno);
+	} else if (size == 0) {
+		fuse_reply_xattr(req, rc);
+	} else {
+		fuse_reply_buf(req, list, rc);
 	}
-	return 0;
+	free(list);
 }
 
-static int
-epochfs_removexattr(const char *path, const char *name)
+static void
+epochfs_removexattr(fuse_req_t req, fuse_ino_t ino, const char *name)
 {
 	int rc;
-	char fullpath[PATH_MAX];
-	epochfs_mkfullpath(path, fullpath);
+	char procpath[PATH_MAX];
+	epochfs_mkprocpath(epochfs_inode(ino), procpath);
 
-	EPOCHFS_DEBUG_LOG("path=%s name=%s", path, name);
+	EPOCHFS_DEBUG_LOG("ino=%lu name=%s", ino, name);
 
-	rc = lremovexattr(fullpath, name);
+	rc = removexattr(procpath, name);
+	epochfs_xcache_drop(epochfs_inode(ino), name);
 	if (rc < 0) {
 		EPOCHFS_ERRNO_LOG(errno);
-		return -errno;
+		fuse_reply_err(req, errno);
+		return;
 	}
-	return 0;
+	epochfs_inode_inval(epochfs_inode(ino));
+	fuse_reply_err(req, 0);
 }
 
 /* ---------------------------------------------------------------------
  * ディレクトリ操作
  * --------------------------------------------------------------------- */
-static int
-epochfs_opendir(const char *pathname, struct fuse_file_info *fi)
+
+#define EPOCHFS_DIRBUF_SIZE	(64 * 1024)
+
+/*
+ * ディレクトリハンドル
+ * getdents64(2)の結果をbufに保持し、応答バッファの大きさ分ずつ返す。
+ * offsetはカーネルが返したd_off(次のエントリのseek cookie)で、
+ * クライアントへのoffsetとしてもそのまま使う。
+ * ディレクトリの大きさによらず、メモリ使用量はbuf分で一定となる。
+ */
+struct epochfs_dirp
+{
+	int fd;
+	off_t offset;
+	char *buf;
+	size_t bpos;
+	size_t blen;
+};
+
+static inline struct epochfs_dirp *
+epochfs_dirp(struct fuse_file_info *fi)
+{
+	return (struct epochfs_dirp *)(uintptr_t)fi->fh;
+}
+
+static void
+epochfs_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
 {
-	DIR *dirp;
-	char fullpathname[PATH_MAX];
-	epochfs_mkfullpath(pathname, fullpathname);
+	struct epochfs_dirp *d;
+	int fd;
+	struct epochfs_inode *inode = epochfs_inode(ino);
+
+	EPOCHFS_DEBUG_LOG("ino=%lu", ino);
 
-	EPOCHFS_DEBUG_LOG("pathname=%s", pathname);
+	d = calloc(1, sizeof(*d));
+	if (d == NULL) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+	d->buf = malloc(EPOCHFS_DIRBUF_SIZE);
+	if (d->buf == NULL) {
+		fuse_reply_err(req, ENOMEM);
+		free(d);
+		return;
+	}
 
-	dirp = opendir(fullpathname);
-	if (dirp == NULL) {
+	fd = openat(inode->fd, ".", O_RDONLY | O_DIRECTORY);
+	if (fd < 0) {
 		EPOCHFS_ERRNO_LOG(errno);
-		return -errno;
+		fuse_reply_err(req, errno);
+		free(d->buf);
+		free(d);
+		return;
 	}
-	fi->fh = (unsigned long)dirp;
-	return 0;
+	d->fd = fd;
+	fi->fh = (uintptr_t)d;
+	fuse_reply_open(req, fi);
 }
 
-static int
-epochfs_readdir(const char *pathname, void *buf, fuse_fill_dir_t filler,
-	      off_t offset, struct fuse_file_info *fi)
+/*
+ * readdir/readdirplusの共通処理
+ * plusの場合は各エントリをlookupし、epoch時間をずらした属性と
+ * タイムアウトを一緒に応答する。lookupしたエントリは応答に含めた時点で
+ * カーネルがnlookupを1つ保持する。
+ */
+static void
+epochfs_do_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
+		   struct fuse_file_info *fi, int plus)
 {
-	DIR *dirp = (DIR *)fi->fh;
-	struct dirent *dirent;
-	int ret;
+	struct epochfs_dirp *d = epochfs_dirp(fi);
+	struct epochfs_inode *dir = epochfs_inode(ino);
+	struct fuse_entry_param e;
+	struct dirent64 *dirent;
+	ssize_t nread;
+	char *buf;
+	char *p;
+	const char *name;
+	size_t rem;
+	size_t entsize;
+	int err = 0;
+
+	EPOCHFS_DEBUG_LOG("ino=%lu size=%ld offset=%ld plus=%d",
+			  ino, size, offset, plus);
+
+	buf = malloc(size);
+	if (buf == NULL) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+
+	// seekされた場合はcookieの位置から読み直す
+	if (offset != d->offset) {
+		if (lseek(d->fd, offset, SEEK_SET) < 0) {
+			err = errno;
+			EPOCHFS_ERRNO_LOG(err);
+			fuse_reply_err(req, err);
+			free(buf);
+			return;
+		}
+		d->offset = offset;
+		d->bpos = 0;
+		d->blen = 0;
+	}
+
+	for (p = buf, rem = size; ; ) {
+		if (d->bpos >= d->blen) {
+			nread = getdents64(d->fd, d->buf, EPOCHFS_DIRBUF_SIZE);
+			if (nread <= 0) {
+				err = (nread < 0) ? errno : 0;
+				break;
+			}
+			d->blen = nread;
+			d->bpos = 0;
+		}
+		dirent = (struct dirent64 *)(d->buf + d->bpos);
+		name = dirent->d_name;
+		if (epochfs_is_trash(dir, name)) {
+			d->bpos += dirent->d_reclen;
+			d->offset = dirent->d_off;
+			continue;
+		}
 
-	EPOCHFS_DEBUG_LOG("pathname=%s", pathname);
+		// d_typeとd_inoを渡し、呼び出し元がgetattrせずに種別を判定できるようにする
+		memset(&e, 0, sizeof(e));
+		e.attr.st_ino = epochfs_map_ino(dir->dev, dirent->d_ino);
+		e.attr.st_mode = DTTOIF(dirent->d_type);
+
+		if (!plus) {
+			entsize = fuse_add_direntry(req, p, rem, name,
+						    &e.attr, dirent->d_off);
+		} else {
+			// lookupに失敗したエントリはino=0とし、属性なしで返す
+			if (!epochfs_is_dot_or_dotdot(name) &&
+			    epochfs_do_lookup(ino, name, &e) < 0) {
+				memset(&e, 0, sizeof(e));
+				e.attr.st_ino = epochfs_map_ino(dir->dev,
+								dirent->d_ino);
+				e.attr.st_mode = DTTOIF(dirent->d_type);
+			}
+			entsize = fuse_add_direntry_plus(req, p, rem, name,
+							 &e, dirent->d_off);
+			if (entsize > rem && e.ino != 0) {
+				epochfs_inode_put(epochfs_inode(e.ino), 1);
+			}
+		}
+		if (entsize > rem) {
+			break;
+		}
+		p += entsize;
+		rem -= entsize;
+		d->bpos += dirent->d_reclen;
+		d->offset = dirent->d_off;
+	}
 
-	for (ret = 0, dirent = readdir(dirp);
-	     dirent != NULL && ret == 0;
-	     dirent = readdir(dirp)) {
-		ret = filler(buf, dirent->d_name, NULL, 0);
+	if (err != 0 && rem == size) {
+		EPOCHFS_ERRNO_LOG(err);
+		fuse_reply_err(req, err);
+	} else {
+		fuse_reply_buf(req, buf, size - rem);
 	}
+	free(buf);
+}
 
-	return 0;
+static void
+epochfs_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
+		struct fuse_file_info *fi)
+{
+	epochfs_do_readdir(req, ino, size, offset, fi, 0);
 }
 
-static int
-epochfs_releasedir(const char *pathname, struct fuse_file_info *fi)
+static void
+epochfs_readdirplus(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
+		    struct fuse_file_info *fi)
+{
+	epochfs_do_readdir(req, ino, size, offset, fi, 1);
+}
+
+static void
+epochfs_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
 {
 	int rc;
-	DIR *dirp = (DIR *)fi->fh;
+	struct epochfs_dirp *d = epochfs_dirp(fi);
 
-	EPOCHFS_DEBUG_LOG("pathname=%s", pathname);
+	EPOCHFS_DEBUG_LOG("ino=%lu", ino);
 
-	rc = closedir(dirp);
+	rc = close(d->fd);
+	free(d->buf);
+	free(d);
 	if (rc < 0) {
 		EPOCHFS_ERRNO_LOG(errno);
-		return -errno;
+		fuse_reply_err(req, errno);
+		return;
 	}
-	return 0;
+	fuse_reply_err(req, 0);
 }
 
 /* ---------------------------------------------------------------------
  * ファイル操作
  * --------------------------------------------------------------------- */
-static int
-epochfs_open(const char *pathname, struct fuse_file_info *fi)
+static void
+epochfs_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
 {
 	int fd;
-	char fullpathname[PATH_MAX];
-	epochfs_mkfullpath(pathname, fullpathname);
+	char procpath[PATH_MAX];
+	epochfs_mkprocpath(epochfs_inode(ino), procpath);
 
-	EPOCHFS_DEBUG_LOG("pathname=%s flags=0x%08X", pathname, fi->flags);
+	EPOCHFS_DEBUG_LOG("ino=%lu flags=0x%08X", ino, fi->flags);
+
+	if (epochfs_uring_open(req, epochfs_inode(ino), fi) == 0) {
+		return;
+	}
 
-	fd = open(fullpathname, fi->flags);
+	// O_PATHハンドルは読み書きに使えないため、/proc経由で開き直す
+	fd = open(procpath, fi->flags & ~O_NOFOLLOW);
 	if (fd < 0) {
 		EPOCHFS_ERRNO_LOG(errno);
-		return -errno;
+		fuse_reply_err(req, errno);
+		return;
 	}
 	fi->fh = (unsigned long)fd;
+	// O_TRUNCはデーモン内で切り詰めるため、キャッシュ済みの属性を捨てる
+	if (fi->flags & O_TRUNC) {
+		epochfs_inode_inval(epochfs_inode(ino));
+	}
+	epochfs_passthrough_open(req, epochfs_inode(ino), fi);
 
-	EPOCHFS_DEBUG_LOG("pathname=%s fd=%d", pathname, fd);
-	return 0;
+	EPOCHFS_DEBUG_LOG("ino=%lu fd=%d", ino, fd);
+	fuse_reply_open(req, fi);
 }
 
-static int
-epochfs_create(const char *pathname, mode_t mode, struct fuse_file_info *fi)
+static void
+epochfs_create(fuse_req_t req, fuse_ino_t parent, const char *name,
+	       mode_t mode, struct fuse_file_info *fi)
 {
 	int fd;
-	char fullpathname[PATH_MAX];
-	epochfs_mkfullpath(pathname, fullpathname);
+	int rc;
+	struct fuse_entry_param e;
+	struct epochfs_inode *dir = epochfs_inode(parent);
+
+	EPOCHFS_DEBUG_LOG("parent=%lu name=%s flags=0x%08X",
+			  parent, name, fi->flags);
 
-	EPOCHFS_DEBUG_LOG("pathname=%s flags=0x%08X", pathname, fi->flags);
+	if (epochfs_is_trash(dir, name)) {
+		fuse_reply_err(req, EPERM);
+		return;
+	}
 
-	fd = creat(fullpathname, mode);
+	/*
+	 * 所有者を変更する場合は、既存のファイルを開いたときに所有者や
+	 * モードを変更しないよう、まずO_EXCLで作成を試みる。既存であれば
+	 * O_CREATなしで開き直し、その間に削除された場合は作成からやり直す。
+	 */
+	if (!epochfs.default_permissions || !epochfs.as_root) {
+		fd = openat(dir->fd, name, (fi->flags | O_CREAT) & ~O_NOFOLLOW,
+			    mode);
+	} else {
+		for (;;) {
+			fd = openat(dir->fd, name,
+				    (fi->flags | O_CREAT | O_EXCL) & ~O_NOFOLLOW,
+				    epochfs_create_mode(mode));
+			if (fd >= 0) {
+				epochfs_set_owner(req, dir, name, S_IFREG | mode);
+				break;
+			}
+			if (errno != EEXIST || (fi->flags & O_EXCL)) {
+				break;
+			}
+			fd = openat(dir->fd, name,
+				    fi->flags & ~(O_CREAT | O_NOFOLLOW));
+			if (fd >= 0 || errno != ENOENT) {
+				break;
+			}
+		}
+	}
 	if (fd < 0) {
 		EPOCHFS_ERRNO_LOG(errno);
-		return -errno;
+		fuse_reply_err(req, errno);
+		return;
+	}
+
+	epochfs_inode_inval(dir);
+	epochfs_dcache_inval(dir, name);
+	rc = epochfs_do_lookup(parent, name, &e);
+	if (rc < 0) {
+		close(fd);
+		fuse_reply_err(req, -rc);
+		return;
 	}
 	fi->fh = (unsigned long)fd;
+	epochfs_passthrough_open(req, epochfs_inode(e.ino), fi);
 
-	EPOCHFS_DEBUG_LOG("pathname=%s fd=%d", pathname, fd);
-	return 0;
+	EPOCHFS_DEBUG_LOG("name=%s fd=%d", name, fd);
+	fuse_reply_create(req, &e, fi);
 }
 
-static int
-epochfs_read(const char *pathname, char *buf, size_t count, off_t offset,
+/*
+ * データはバッキングfdを指すfuse_bufvecで応答する。splice_writeが
+ * 有効であれば、libfuseはバッキングfdから/dev/fuseへspliceするため
+ * デーモン内でのコピーが発生しない。
+ */
+static void
+epochfs_read(fuse_req_t req, fuse_ino_t ino, size_t count, off_t offset,
 	     struct fuse_file_info *fi)
 {
 	int fd = (int)fi->fh;
-	ssize_t ret;
+	struct fuse_bufvec buf = FUSE_BUFVEC_INIT(count);
 
-	EPOCHFS_DEBUG_LOG("pathname=%s fd=%d", pathname, fd);
+	EPOCHFS_DEBUG_LOG("ino=%lu fd=%d count=%ld offset=%ld",
+			  ino, fd, count, offset);
 
-	ret = pread(fd, (void*)buf, count, offset);
-	if (ret < 0) {
-		EPOCHFS_ERRNO_LOG(errno);
-		return -errno;
+	// spliceしない場合はio_uringで読み込み、スレッドを待たせない
+	if (!epochfs.splice_write &&
+	    epochfs_uring_read(req, fd, count, offset) == 0) {
+		return;
 	}
-	return ret;
+
+	buf.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+	buf.buf[0].fd = fd;
+	buf.buf[0].pos = offset;
+
+	fuse_reply_data(req, &buf,
+			epochfs.splice_move ? FUSE_BUF_SPLICE_MOVE : 0);
 }
 
-static int
-epochfs_write(const char *pathname, const char *buf, size_t count, off_t offset,
-	     struct fuse_file_info *fi)
+/*
+ * splice_readが有効な場合、書き込みデータは/dev/fuseからのパイプとして
+ * 渡されるため、fuse_buf_copy()でバッキングfdへ直接spliceする。
+ */
+static void
+epochfs_write_buf(fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *in_buf,
+		  off_t offset, struct fuse_file_info *fi)
 {
 	int fd = (int)fi->fh;
 	ssize_t ret;
+	struct fuse_bufvec out_buf = FUSE_BUFVEC_INIT(fuse_buf_size(in_buf));
 
-	EPOCHFS_DEBUG_LOG("pathname=%s fd=%d", pathname, fd);
+	EPOCHFS_DEBUG_LOG("ino=%lu fd=%d count=%ld offset=%ld",
+			  ino, fd, fuse_buf_size(in_buf), offset);
 
-	ret = pwrite(fd, (void*)buf, count, offset);
+	out_buf.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+	out_buf.buf[0].fd = fd;
+	out_buf.buf[0].pos = offset;
+
+	ret = fuse_buf_copy(&out_buf, in_buf,
+			    epochfs.splice_move ? FUSE_BUF_SPLICE_MOVE : 0);
 	if (ret < 0) {
-		EPOCHFS_ERRNO_LOG(errno);
-		return -errno;
+		EPOCHFS_DEBUG_LOG("ino=%lu ret=%ld", ino, ret);
+		fuse_reply_err(req, -ret);
+		return;
 	}
-	return ret;
+	epochfs_inode_inval(epochfs_inode(ino));
+	__atomic_add_fetch(&epochfs.statfs_written, ret, __ATOMIC_RELAXED);
+	fuse_reply_write(req, ret);
 }
 
-static int
-epochfs_fsync(const char *pathname, int datasync, struct fuse_file_info *fi)
+static void
+epochfs_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+	      struct fuse_file_info *fi)
 {
 	int fd = (int)fi->fh;
 	int rc;
 
-	EPOCHFS_DEBUG_LOG("pathname=%s fd=%d datasync=%d",
-			  pathname, fd, datasync);
+	EPOCHFS_DEBUG_LOG("ino=%lu fd=%d datasync=%d", ino, fd, datasync);
+
+	if (epochfs_gsync_queue(req, epochfs_inode(ino), fd, datasync) == 0) {
+		return;
+	}
+	if (epochfs_uring_fsync(req, fd, datasync) == 0) {
+		return;
+	}
 
 	if (datasync) {
 		rc = fdatasync(fd);
 		if (rc < 0) {
 			EPOCHFS_ERRNO_LOG(errno);
-			return -errno;
+			fuse_reply_err(req, errno);
+			return;
 		}
 	} else {
 		rc = fsync(fd);
 		if (rc < 0) {
 			EPOCHFS_ERRNO_LOG(errno);
-			return -errno;
+			fuse_reply_err(req, errno);
+			return;
 		}
 	}
-	return 0;
+	fuse_reply_err(req, 0);
 }
 
-static int
-epochfs_flush(const char *pathname, struct fuse_file_info *fi)
+/*
+ * close(2)のたびに呼ばれる。既定ではPOSIXと同じく同期せず、dupしたfdを
+ * closeしてバッキングFSが遅延して報告するエラーだけを返す。
+ * flush=closeの場合のみ、書き込み可能で開いたファイルを同期する。
+ */
+static void
+epochfs_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
 {
 	int fd = (int)fi->fh;
 	int rc;
 
-	EPOCHFS_DEBUG_LOG("pathname=%s fd=%d", pathname, fd);
+	EPOCHFS_DEBUG_LOG("ino=%lu fd=%d", ino, fd);
 
-	rc = fdatasync(fd);
-	if (rc < 0) {
-		EPOCHFS_ERRNO_LOG(errno);
-		return -errno;
+	if (epochfs.flush == EPOCHFS_FLUSH_CLOSE &&
+	    (fi->flags & O_ACCMODE) != O_RDONLY) {
+		rc = fsync(fd);
+		if (rc < 0) {
+			EPOCHFS_ERRNO_LOG(errno);
+			fuse_reply_err(req, errno);
+			return;
+		}
 	}
-	rc = fsync(fd);
+
+	rc = close(dup(fd));
 	if (rc < 0) {
 		EPOCHFS_ERRNO_LOG(errno);
-		return -errno;
+		fuse_reply_err(req, errno);
+		return;
 	}
-	return 0;
+	fuse_reply_err(req, 0);
 }
 
-static int
-epochfs_ftruncate(const char *pathname, off_t length,
-		  struct fuse_file_info *fi)
+static void
+epochfs_flock(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi,
+	      int op)
 {
 	int fd = (int)fi->fh;
 	int rc;
 
-	EPOCHFS_DEBUG_LOG("pathname=%s fd=%d length=%ld", pathname, fd, length);
+	EPOCHFS_DEBUG_LOG("ino=%lu fd=%d op=%d", ino, fd, op);
 
-	rc = ftruncate(fd, length);
+	rc = flock(fd, op);
 	if (rc < 0) {
 		EPOCHFS_ERRNO_LOG(errno);
-		return -errno;
+		fuse_reply_err(req, errno);
+		return;
 	}
-	return 0;
+	fuse_reply_err(req, 0);
 }
 
-static int
-epochfs_fgetattr(const char *pathname, struct stat *buf,
-		 struct fuse_file_info *fi)
+static void
+epochfs_fallocate(fuse_req_t req, fuse_ino_t ino, int mode, off_t offset,
+		  off_t len, struct fuse_file_info *fi)
 {
 	int fd = (int)fi->fh;
 	int rc;
 
-	EPOCHFS_DEBUG_LOG("pathname=%s fd=%d buf=%p", pathname, fd, buf);
+	EPOCHFS_DEBUG_LOG("ino=%lu fd=%d mode=%d offset=%ld len=%ld",
+			  ino, fd, mode, offset, len);
 
-	rc = fstat(fd, buf);
+	rc = fallocate(fd, mode, offset, len);
 	if (rc < 0) {
 		EPOCHFS_ERRNO_LOG(errno);
-		return -errno;
+		fuse_reply_err(req, errno);
+		return;
 	}
-
-	// epoch時間をずらして応答する
-	buf->st_atime = epochfs_epoch_unix2local(buf->st_atime);
-	buf->st_mtime = epochfs_epoch_unix2local(buf->st_mtime);
-	buf->st_ctime = epochfs_epoch_unix2local(buf->st_ctime);
-	return 0;
+	epochfs_inode_inval(epochfs_inode(ino));
+	fuse_reply_err(req, 0);
 }
 
-static int
-epochfs_flock(const char *pathname, struct fuse_file_info *fi, int op)
+static void
+epochfs_getlk(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi,
+	      struct flock *fl)
 {
 	int fd = (int)fi->fh;
 	int rc;
 
-	EPOCHFS_DEBUG_LOG("pathname=%s fd=%d op=%d", pathname, fd, op);
+	EPOCHFS_DEBUG_LOG("ino=%lu fd=%d fl=%p", ino, fd, fl);
 
-	rc = flock(fd, op);
+	rc = fcntl(fd, F_GETLK, fl);
 	if (rc < 0) {
 		EPOCHFS_ERRNO_LOG(errno);
-		return -errno;
+		fuse_reply_err(req, errno);
+		return;
 	}
-	return 0;
+	fuse_reply_lock(req, fl);
 }
 
-static int
-epochfs_fallocate(const char *pathname, int mode, off_t offset, off_t len,
-		  struct fuse_file_info *fi)
+static void
+epochfs_setlk(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi,
+	      struct flock *fl, int sleep)
 {
 	int fd = (int)fi->fh;
 	int rc;
 
-	EPOCHFS_DEBUG_LOG("pathname=%s fd=%d mode=%d offset=%ld len=%ld",
-			  pathname, fd, mode, offset, len);
+	EPOCHFS_DEBUG_LOG("ino=%lu fd=%d fl=%p sleep=%d", ino, fd, fl, sleep);
 
-	rc = fallocate(fd, mode, offset, len);
+	rc = fcntl(fd, sleep ? F_SETLKW : F_SETLK, fl);
 	if (rc < 0) {
 		EPOCHFS_ERRNO_LOG(errno);
-		return -errno;
+		fuse_reply_err(req, errno);
+		return;
 	}
-	return 0;
+	fuse_reply_err(req, 0);
 }
 
-static int
-epochfs_lock(const char *pathname, struct fuse_file_info *fi, int cmd,
-	     struct flock *fl)
+static void
+epochfs_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
 {
 	int fd = (int)fi->fh;
 	int rc;
 
-	EPOCHFS_DEBUG_LOG("pathname=%s fd=%d cmd=%d fl=%p",
-			  pathname, fd, cmd, fl);
+	EPOCHFS_DEBUG_LOG("ino=%lu fd=%d", ino, fd);
+
+	epochfs_passthrough_release(req, epochfs_inode(ino), fi);
+	fi->fh = (unsigned long)-1;
+	// closeを遅らせてもflockは他のプロセスから見えなくなるよう先に解放する
+	if (fi->flock_release && epochfs.async_release &&
+	    flock(fd, LOCK_UN) < 0) {
+		EPOCHFS_ERRNO_LOG(errno);
+	}
+	if (epochfs_closer_queue(fd) == 0) {
+		fuse_reply_err(req, 0);
+		return;
+	}
 
-	rc = fcntl(fd, cmd, fl);
+	rc = close(fd);
 	if (rc < 0) {
 		EPOCHFS_ERRNO_LOG(errno);
-		return -errno;
+		fuse_reply_err(req, errno);
+		return;
 	}
-	return 0;
+	fuse_reply_err(req, 0);
 }
 
-static int
-epochfs_release(const char *pathname, struct fuse_file_info *fi)
+/* ---------------------------------------------------------------------
+ * 統計情報
+ * --------------------------------------------------------------------- */
+
+// SIGUSR1受信時とアンマウント時にログへ出力する
+static void
+epochfs_stats_dump(void)
 {
-	int fd = (int)fi->fh;
-	int rc;
+	struct epochfs_acache_shard *sh;
+	uint64_t hits = 0;
+	uint64_t misses = 0;
+	uint64_t evictions = 0;
+	uint64_t lookups;
+	uint64_t requests;
+	uint64_t batches;
+	uint64_t syscalls;
+	int i;
 
-	EPOCHFS_DEBUG_LOG("pathname=%s fd=%d", pathname, fd);
+	for (i = 0; i < EPOCHFS_ACACHE_SHARDS; i++) {
+		sh = &epochfs.acache[i];
+		pthread_mutex_lock(&sh->lock);
+		hits += sh->hits;
+		misses += sh->misses;
+		evictions += sh->evictions;
+		pthread_mutex_unlock(&sh->lock);
+	}
+	fuse_log(FUSE_LOG_INFO,
+		 "epochfs: attr_cache hits=%lu misses=%lu evictions=%lu\n",
+		 hits, misses, evictions);
+
+	pthread_mutex_lock(&epochfs.itable_lock);
+	lookups = epochfs.itable_hits + epochfs.itable_misses;
+	fuse_log(FUSE_LOG_INFO,
+		 "epochfs: handles entries=%lu hits=%lu misses=%lu "
+		 "hit_ratio=%.2f\n", epochfs.itable_count,
+		 epochfs.itable_hits, epochfs.itable_misses,
+		 lookups ? (double)epochfs.itable_hits / lookups : 0.0);
+	pthread_mutex_unlock(&epochfs.itable_lock);
+	fuse_log(FUSE_LOG_INFO, "epochfs: fds used=%ld limit=%lu\n",
+		 epochfs_nofile_used(), (unsigned long)epochfs.nofile_limit);
+
+	if (epochfs.statfs_cache_ttl > 0) {
+		pthread_mutex_lock(&epochfs.statfs_lock);
+		fuse_log(FUSE_LOG_INFO,
+			 "epochfs: statfs_cache hits=%lu misses=%lu\n",
+			 epochfs.statfs_hits, epochfs.statfs_misses);
+		pthread_mutex_unlock(&epochfs.statfs_lock);
+	}
 
-	rc = close(fd);
-	if (rc < 0) {
-		EPOCHFS_ERRNO_LOG(errno);
-		return -errno;
+	fuse_log(FUSE_LOG_INFO, "epochfs: readlink hits=%lu misses=%lu\n",
+		 __atomic_load_n(&epochfs.link_hits, __ATOMIC_RELAXED),
+		 __atomic_load_n(&epochfs.link_misses, __ATOMIC_RELAXED));
+
+	pthread_mutex_lock(&epochfs.xcache_lock);
+	fuse_log(FUSE_LOG_INFO, "epochfs: xattr_cache hits=%lu misses=%lu\n",
+		 epochfs.xcache_hits, epochfs.xcache_misses);
+	pthread_mutex_unlock(&epochfs.xcache_lock);
+
+	pthread_mutex_lock(&epochfs.dcache_lock);
+	fuse_log(FUSE_LOG_INFO,
+		 "epochfs: neg_cache hits=%lu misses=%lu entries=%lu\n",
+		 epochfs.dcache_neg_hits, epochfs.dcache_neg_misses,
+		 epochfs.dcache_count);
+	fuse_log(FUSE_LOG_INFO,
+		 "epochfs: entry_cache hits=%lu misses=%lu entries=%lu\n",
+		 epochfs.dcache_pos_hits, epochfs.dcache_pos_misses,
+		 epochfs.dcache_pos_count);
+	pthread_mutex_unlock(&epochfs.dcache_lock);
+
+	if (epochfs.backing_uring) {
+		fuse_log(FUSE_LOG_INFO,
+			 "epochfs: backing_uring submits=%lu fallbacks=%lu inflight=%lu\n",
+			 __atomic_load_n(&epochfs.uring_submits, __ATOMIC_RELAXED),
+			 __atomic_load_n(&epochfs.uring_fallbacks,
+					 __ATOMIC_RELAXED),
+			 __atomic_load_n(&epochfs.uring_inflight,
+					 __ATOMIC_RELAXED));
 	}
-	fi->fh = (unsigned long)-1;
-	return 0;
+
+	if (epochfs.fsync_window != 0) {
+		pthread_mutex_lock(&epochfs.gsync_lock);
+		requests = epochfs.gsync_requests;
+		batches = epochfs.gsync_batches;
+		pthread_mutex_unlock(&epochfs.gsync_lock);
+		syscalls = __atomic_load_n(&epochfs.gsync_syscalls,
+					   __ATOMIC_RELAXED);
+		fuse_log(FUSE_LOG_INFO,
+			 "epochfs: fsync requests=%lu batches=%lu syscalls=%lu "
+			 "factor=%.2f\n", requests, batches, syscalls,
+			 syscalls ? (double)requests / syscalls : 0.0);
+	}
+
+	if (epochfs.async_release) {
+		pthread_mutex_lock(&epochfs.closer_lock);
+		fuse_log(FUSE_LOG_INFO,
+			 "epochfs: async_release closes=%lu errors=%lu "
+			 "queued=%u waits=%lu\n",
+			 __atomic_load_n(&epochfs.closer_closes,
+					 __ATOMIC_RELAXED),
+			 __atomic_load_n(&epochfs.closer_errors,
+					 __ATOMIC_RELAXED),
+			 epochfs.closer_count, epochfs.closer_waits);
+		pthread_mutex_unlock(&epochfs.closer_lock);
+	}
+
+	if (epochfs.trash_threshold != 0) {
+		pthread_mutex_lock(&epochfs.trash_lock);
+		fuse_log(FUSE_LOG_INFO,
+			 "epochfs: trash pending_files=%lu pending_bytes=%lu "
+			 "deleted=%lu\n", epochfs.trash_files,
+			 epochfs.trash_pending, epochfs.trash_deleted);
+		pthread_mutex_unlock(&epochfs.trash_lock);
+	}
+
+	if (epochfs.flush == EPOCHFS_FLUSH_PERIODIC) {
+		fuse_log(FUSE_LOG_INFO, "epochfs: periodic syncs=%lu errors=%lu\n",
+			 __atomic_load_n(&epochfs.syncer_syncs,
+					 __ATOMIC_RELAXED),
+			 __atomic_load_n(&epochfs.syncer_errors,
+					 __ATOMIC_RELAXED));
+	}
+
+	if (epochfs.watch) {
+		fuse_log(FUSE_LOG_INFO,
+			 "epochfs: watch events=%lu overflows=%lu failures=%lu\n",
+			 __atomic_load_n(&epochfs.watch_events, __ATOMIC_RELAXED),
+			 __atomic_load_n(&epochfs.watch_overflows,
+					 __ATOMIC_RELAXED),
+			 __atomic_load_n(&epochfs.watch_failures,
+					 __ATOMIC_RELAXED));
+	}
+}
+
+static void *
+epochfs_stats_thread(void *arg)
+{
+	sigset_t set;
+	int sig;
+
+	sigemptyset(&set);
+	sigaddset(&set, SIGUSR1);
+	for (;;) {
+		if (sigwait(&set, &sig) == 0) {
+			epochfs_stats_dump();
+		}
+	}
+	return NULL;
+}
+
+// デーモン化した場合は標準エラー出力が捨てられるため、syslogへ出力する
+static void
+epochfs_syslog_func(enum fuse_log_level level, const char *fmt, va_list ap)
+{
+	vsyslog(level, fmt, ap);
+}
+
+/* ---------------------------------------------------------------------
+ * super操作
+ * --------------------------------------------------------------------- */
+static const struct {
+	uint32_t cap;
+	const char *name;
+} epochfs_caps[] = {
+	{ FUSE_CAP_ASYNC_READ,		"async_read" },
+	{ FUSE_CAP_PARALLEL_DIROPS,	"parallel_dirops" },
+	{ FUSE_CAP_ASYNC_DIO,		"async_dio" },
+	{ FUSE_CAP_AUTO_INVAL_DATA,	"auto_inval_data" },
+	{ FUSE_CAP_SPLICE_READ,		"splice_read" },
+	{ FUSE_CAP_SPLICE_WRITE,	"splice_write" },
+	{ FUSE_CAP_SPLICE_MOVE,		"splice_move" },
+#ifdef FUSE_CAP_PASSTHROUGH
+	{ FUSE_CAP_PASSTHROUGH,		"passthrough" },
+#endif
+	{ FUSE_CAP_CACHE_SYMLINKS,	"cache_symlinks" },
+	{ FUSE_CAP_READDIRPLUS,		"readdirplus" },
+	{ FUSE_CAP_READDIRPLUS_AUTO,	"readdirplus_auto" },
+	{ FUSE_CAP_POSIX_LOCKS,		"posix_locks" },
+	{ FUSE_CAP_FLOCK_LOCKS,		"flock_locks" },
+	{ FUSE_CAP_ATOMIC_O_TRUNC,	"atomic_o_trunc" },
+};
+
+// カーネルが対応していれば要求し、無効が指定されていれば要求を取り下げる
+static void
+epochfs_conn_want(struct fuse_conn_info *conn, uint32_t cap, int enable)
+{
+	if (!enable) {
+		conn->want &= ~cap;
+	} else if (conn->capable & cap) {
+		conn->want |= cap;
+	}
+}
+
+static void
+epochfs_ll_init(void *userdata, struct fuse_conn_info *conn)
+{
+	size_t i;
+
+	EPOCHFS_DEBUG_LOG("capable=0x%08X want=0x%08X",
+			  conn->capable, conn->want);
+
+	epochfs_conn_want(conn, FUSE_CAP_PARALLEL_DIROPS, epochfs.parallel_dirops);
+	epochfs_conn_want(conn, FUSE_CAP_ASYNC_DIO, epochfs.async_dio);
+	epochfs_conn_want(conn, FUSE_CAP_AUTO_INVAL_DATA, epochfs.auto_inval_data);
+	epochfs_conn_want(conn, FUSE_CAP_SPLICE_READ, epochfs.splice_read);
+	epochfs_conn_want(conn, FUSE_CAP_SPLICE_WRITE, epochfs.splice_write);
+	epochfs_conn_want(conn, FUSE_CAP_SPLICE_MOVE, epochfs.splice_move);
+	epochfs_conn_want(conn, FUSE_CAP_CACHE_SYMLINKS, epochfs.cache_symlinks);
+#ifdef FUSE_CAP_PASSTHROUGH
+	epochfs_conn_want(conn, FUSE_CAP_PASSTHROUGH, epochfs.passthrough);
+	epochfs.passthrough = !!(conn->want & FUSE_CAP_PASSTHROUGH);
+#else
+	epochfs.passthrough = 0;
+#endif
+
+	/*
+	 * io_uringの通信路はカーネル6.14以降で使える。非対応の場合、
+	 * fuse_set_feature_flag()は何もせず/dev/fuseのread/writeで処理する。
+	 */
+#ifdef FUSE_CAP_OVER_IO_URING
+	if (epochfs.io_uring) {
+		fuse_set_feature_flag(conn, FUSE_CAP_OVER_IO_URING);
+	} else {
+		fuse_unset_feature_flag(conn, FUSE_CAP_OVER_IO_URING);
+	}
+#endif
+
+	if (epochfs.max_background != 0) {
+		conn->max_background = epochfs.max_background;
+	}
+	if (epochfs.congestion_threshold != 0) {
+		conn->congestion_threshold = epochfs.congestion_threshold;
+	}
+
+	/*
+	 * readdirplusを実装している場合、libfuseはREADDIRPLUSと
+	 * READDIRPLUS_AUTOの両方を要求する。AUTOではカーネルが
+	 * ディレクトリ内でlookupが続いた場合のみreaddirplusを使う。
+	 */
+	if (epochfs.readdirplus == EPOCHFS_READDIRPLUS_YES) {
+		conn->want &= ~FUSE_CAP_READDIRPLUS_AUTO;
+	}
+
+	fuse_log(FUSE_LOG_INFO, "epochfs: FUSE protocol %u.%u\n",
+		 conn->proto_major, conn->proto_minor);
+	for (i = 0; i < sizeof(epochfs_caps) / sizeof(epochfs_caps[0]); i++) {
+		fuse_log(FUSE_LOG_INFO, "epochfs: %-16s %s\n",
+			 epochfs_caps[i].name,
+			 (conn->want & epochfs_caps[i].cap) ? "enabled" :
+			 (conn->capable & epochfs_caps[i].cap) ? "disabled" :
+			 "not supported");
+	}
+#ifdef FUSE_CAP_OVER_IO_URING
+	fuse_log(FUSE_LOG_INFO, "epochfs: %-16s %s\n", "io_uring",
+		 (conn->want_ext & FUSE_CAP_OVER_IO_URING) ? "enabled" :
+		 (conn->capable_ext & FUSE_CAP_OVER_IO_URING) ? "disabled" :
+		 "not supported");
+#endif
+	fuse_log(FUSE_LOG_INFO,
+		 "epochfs: max_background=%u congestion_threshold=%u\n",
+		 conn->max_background, conn->congestion_threshold);
+}
+
+/*
+ * アンマウント時に呼ばれる。この時点で処理中の要求はないため、
+ * 監視スレッドを止めてからinodeテーブルとキャッシュをすべて解放する。
+ */
+static void
+epochfs_ll_destroy(void *userdata)
+{
+	EPOCHFS_DEBUG_LOG("userdata=%p", userdata);
+
+	epochfs_watch_stop();
+	epochfs_gsync_stop();
+	epochfs_uring_stop();
+	epochfs_closer_stop();
+	epochfs_trash_stop();
+	epochfs_syncer_stop();
+	epochfs_stats_dump();
+	epochfs_itable_free();
+	epochfs_acache_free();
+	epochfs_dcache_free();
+	epochfs_ino_free();
 }
 
-static struct fuse_operations epochfs_ope = {
+static struct fuse_lowlevel_ops epochfs_ope = {
 	// super operations
-//	.init		= ,
-//	.destroy	= ,
+	.init		= epochfs_ll_init,
+	.destroy	= epochfs_ll_destroy,
 	.statfs		= epochfs_statfs,
 
 	// inode operations
+	.lookup		= epochfs_lookup,
+	.forget		= epochfs_forget,
+	.forget_multi	= epochfs_forget_multi,
 	.getattr	= epochfs_getattr,
+#if FUSE_VERSION >= FUSE_MAKE_VERSION(3, 18)
+	.statx		= epochfs_statx,
+#endif
+	.setattr	= epochfs_setattr,
 	.access		= epochfs_access,
 	.opendir	= epochfs_opendir,
 	.readdir	= epochfs_readdir,
+	.readdirplus	= epochfs_readdirplus,
 	.releasedir	= epochfs_releasedir,
 	.readlink	= epochfs_readlink,
 	.mknod		= epochfs_mknod,
@@ -805,11 +4905,6 @@ static struct fuse_operations epochfs_ope = {
 	.rmdir		= epochfs_rmdir,
 	.rename		= epochfs_rename,
 	.link		= epochfs_link,
-	.chmod		= epochfs_chmod,
-	.chown		= epochfs_chown,
-	.truncate	= epochfs_truncate,
-//	.utimens	= ,
-	.utime		= epochfs_utime,
 	.setxattr	= epochfs_setxattr,
 	.getxattr	= epochfs_getxattr,
 	.listxattr	= epochfs_listxattr,
@@ -821,23 +4916,18 @@ static struct fuse_operations epochfs_ope = {
 	.flush		= epochfs_flush,
 	.fsync		= epochfs_fsync,
 	.read		= epochfs_read,
-	.write		= epochfs_write,
-	.ftruncate	= epochfs_ftruncate,
-	.fgetattr	= epochfs_fgetattr,
+	.write_buf	= epochfs_write_buf,
 	.flock		= epochfs_flock,
 	.fallocate	= epochfs_fallocate,
-	.lock		= epochfs_lock,
+	.getlk		= epochfs_getlk,
+	.setlk		= epochfs_setlk,
 //	.ioctl		= ,
 //	.poll		= ,
 	.release	= epochfs_release,
 
 	// address space operations
 //	.bmap		= ,
-//	.write_buf	= ,
-//	.read_buf	= ,
 
-	// getdirは古いインタフェース。
-	.getdir		= NULL,
 	// fsyncdirは不要。
 	.fsyncdir	= NULL,
 };
@@ -848,15 +4938,159 @@ epochfs_init(void)
 	return epochfs_dbg_init();
 }
 
+/*
+ * base_pathをO_PATHで開き、inodeテーブルのルートとする。
+ * 以降のバッキングファイルへのアクセスはすべてこのハンドルを起点に行う。
+ */
+static int
+epochfs_root_init(void)
+{
+	struct stat st;
+	int rc;
+
+	epochfs.root.fd = open(epochfs.base_path, O_PATH | O_DIRECTORY);
+	if (epochfs.root.fd < 0) {
+		return -errno;
+	}
+	rc = fstat(epochfs.root.fd, &st);
+	if (rc < 0) {
+		rc = -errno;
+		close(epochfs.root.fd);
+		epochfs.root.fd = -1;
+		return rc;
+	}
+	epochfs.root.dev = st.st_dev;
+	epochfs.root.ino = st.st_ino;
+	epochfs.root.nlookup = 2;
+	return 0;
+}
+
+static void
+epochfs_usage(const char *progname)
+{
+	printf("usage: %s -o{options...} mountpoint\n\n", progname);
+	printf("epochfs options:\n"
+	       "    -o base_path=PATH      overlay source directory (required)\n"
+	       "    -o epoch=YEAR          epoch of mountpoint\n"
+	       "    -o attr_timeout=SEC    attribute cache timeout (default 1.0)\n"
+	       "    -o entry_timeout=SEC   entry cache timeout (default 1.0)\n"
+	       "    -o readdirplus=MODE    yes, no or auto (default auto)\n"
+	       "    -o attr_cache_ttl=SEC  daemon attribute cache TTL (default 0, disabled)\n"
+	       "    -o attr_cache_size=N   daemon attribute cache entries (default 65536)\n"
+	       "    -o negative_timeout=SEC  cache nonexistent names (default 0, disabled)\n"
+	       "    -o neg_cache_size=N    daemon negative entries (default 65536)\n"
+	       "    -o entry_cache_ttl=T   cache (parent, name) -> inode in the daemon for T seconds (default 0)\n"
+	       "    -o entry_cache_size=N  daemon positive entries (default 65536)\n"
+	       "    -o xattr_cache_ttl=T   cache getxattr results, including ENODATA (default 0)\n"
+	       "    -o no_security_xattr   answer security.* without the backing file\n"
+	       "    -o default_permissions  kernel checks permissions; access is not used\n"
+	       "    -o statx_dont_sync     stat with AT_STATX_DONT_SYNC (NFS/CIFS)\n"
+	       "    -o ino=backing|hash    inode numbers: backing st_ino, or tagged per\n"
+	       "                           filesystem below base_path (default backing)\n"
+	       "    -o statfs_cache_ttl=T  cache statfs of base_path for T seconds (default 0)\n"
+	       "    -o statfs_cache_bytes=N  refresh cached statfs after N bytes written\n"
+	       "    -o watch               invalidate caches on changes made\n"
+	       "                           directly under base_path (inotify)\n"
+	       "    -o [no_]parallel_dirops  concurrent lookups/creates in a directory (default on)\n"
+	       "    -o [no_]async_dio      asynchronous direct I/O (default on)\n"
+	       "    -o [no_]auto_inval_data  invalidate page cache on mtime change (default on)\n"
+	       "    -o [no_]splice_read    splice write data from /dev/fuse (default on)\n"
+	       "    -o [no_]splice_write   splice read data to /dev/fuse (default on)\n"
+	       "    -o [no_]splice_move    move pages while splicing (default off)\n"
+	       "    -o [no_]passthrough    kernel passthrough of file I/O (default on)\n"
+	       "    -o [no_]cache_symlinks  cache symlink targets in the page cache (default on)\n"
+	       "    -o [no_]io_uring       FUSE-over-io_uring transport (default on)\n"
+	       "    -o io_uring_q_depth=N  requests per io_uring queue\n"
+	       "    -o backing_uring       submit backing file I/O through io_uring\n"
+	       "    -o backing_uring_depth=N  io_uring ring depth (default 256)\n"
+	       "    -o backing_uring_sqpoll  use a kernel SQ polling thread\n"
+	       "    -o flush=none|close|periodic  sync policy on close (default none)\n"
+	       "    -o flush_interval=N    seconds between periodic syncs (default 30)\n"
+	       "    -o fsync_window=USEC   batch concurrent fsyncs within USEC (default 0: off)\n"
+	       "    -o fsync_batch=N       maximum fsyncs per batch (default 64)\n"
+	       "    -o fsync_syncfs        commit a batch on one filesystem with syncfs\n"
+	       "    -o fsync_threads=N     number of threads issuing batched fsyncs (default 4)\n"
+	       "    -o async_release       close backing files in background threads\n"
+	       "    -o release_threads=N   number of close threads (default 2)\n"
+	       "    -o release_queue=N     pending closes before release blocks (default 1024)\n"
+	       "    -o trash_threshold=N   delete files of N bytes or more in the background\n"
+	       "    -o max_background=N    maximum outstanding background requests\n"
+	       "    -o congestion_threshold=N  background requests before congestion\n"
+	       "\n");
+}
+
 #define EPOCHFS_OPT(t, p, v) { t, offsetof(struct epochfs_info, p), v }
 static struct fuse_opt epochfs_opts[] = {
 	EPOCHFS_OPT("base_path=%s",	base_path, 0),
 	EPOCHFS_OPT("epoch=%d",		epoch, 0),
+	EPOCHFS_OPT("attr_timeout=%lf",	attr_timeout, 0),
+	EPOCHFS_OPT("entry_timeout=%lf", entry_timeout, 0),
+	EPOCHFS_OPT("readdirplus=no",	readdirplus, EPOCHFS_READDIRPLUS_NO),
+	EPOCHFS_OPT("readdirplus=yes",	readdirplus, EPOCHFS_READDIRPLUS_YES),
+	EPOCHFS_OPT("readdirplus=auto",	readdirplus, EPOCHFS_READDIRPLUS_AUTO),
+	EPOCHFS_OPT("attr_cache_ttl=%lf", attr_cache_ttl, 0),
+	EPOCHFS_OPT("attr_cache_size=%u", attr_cache_size, 0),
+	EPOCHFS_OPT("negative_timeout=%lf", negative_timeout, 0),
+	EPOCHFS_OPT("neg_cache_size=%u", neg_cache_size, 0),
+	EPOCHFS_OPT("entry_cache_ttl=%lf", entry_cache_ttl, 0),
+	EPOCHFS_OPT("entry_cache_size=%u", entry_cache_size, 0),
+	EPOCHFS_OPT("xattr_cache_ttl=%lf", xattr_cache_ttl, 0),
+	EPOCHFS_OPT("security_xattr",	security_xattr, 1),
+	EPOCHFS_OPT("no_security_xattr", security_xattr, 0),
+	EPOCHFS_OPT("default_permissions", default_permissions, 1),
+	EPOCHFS_OPT("statx_dont_sync",	statx_dont_sync, 1),
+	EPOCHFS_OPT("ino=backing",	ino_mode, EPOCHFS_INO_BACKING),
+	EPOCHFS_OPT("ino=hash",		ino_mode, EPOCHFS_INO_HASH),
+	EPOCHFS_OPT("statfs_cache_ttl=%lf", statfs_cache_ttl, 0),
+	EPOCHFS_OPT("statfs_cache_bytes=%llu", statfs_cache_bytes, 0),
+	EPOCHFS_OPT("watch",		watch, 1),
+	EPOCHFS_OPT("parallel_dirops",	parallel_dirops, 1),
+	EPOCHFS_OPT("no_parallel_dirops", parallel_dirops, 0),
+	EPOCHFS_OPT("async_dio",	async_dio, 1),
+	EPOCHFS_OPT("no_async_dio",	async_dio, 0),
+	EPOCHFS_OPT("auto_inval_data",	auto_inval_data, 1),
+	EPOCHFS_OPT("no_auto_inval_data", auto_inval_data, 0),
+	EPOCHFS_OPT("splice_read",	splice_read, 1),
+	EPOCHFS_OPT("no_splice_read",	splice_read, 0),
+	EPOCHFS_OPT("splice_write",	splice_write, 1),
+	EPOCHFS_OPT("no_splice_write",	splice_write, 0),
+	EPOCHFS_OPT("splice_move",	splice_move, 1),
+	EPOCHFS_OPT("no_splice_move",	splice_move, 0),
+	EPOCHFS_OPT("passthrough",	passthrough, 1),
+	EPOCHFS_OPT("no_passthrough",	passthrough, 0),
+	EPOCHFS_OPT("cache_symlinks",	cache_symlinks, 1),
+	EPOCHFS_OPT("no_cache_symlinks", cache_symlinks, 0),
+	EPOCHFS_OPT("io_uring",		io_uring, 1),
+	EPOCHFS_OPT("no_io_uring",	io_uring, 0),
+	EPOCHFS_OPT("io_uring_q_depth=%u", io_uring_q_depth, 0),
+	EPOCHFS_OPT("backing_uring",	backing_uring, 1),
+	EPOCHFS_OPT("backing_uring_depth=%u", backing_uring_depth, 0),
+	EPOCHFS_OPT("backing_uring_sqpoll", backing_uring_sqpoll, 1),
+	EPOCHFS_OPT("flush=none",	flush, EPOCHFS_FLUSH_NONE),
+	EPOCHFS_OPT("flush=close",	flush, EPOCHFS_FLUSH_CLOSE),
+	EPOCHFS_OPT("flush=periodic",	flush, EPOCHFS_FLUSH_PERIODIC),
+	EPOCHFS_OPT("flush_interval=%u", flush_interval, 0),
+	EPOCHFS_OPT("fsync_window=%u",	fsync_window, 0),
+	EPOCHFS_OPT("fsync_batch=%u",	fsync_batch, 0),
+	EPOCHFS_OPT("fsync_syncfs",	fsync_syncfs, 1),
+	EPOCHFS_OPT("fsync_threads=%u",	fsync_threads, 0),
+	EPOCHFS_OPT("async_release",	async_release, 1),
+	EPOCHFS_OPT("release_threads=%u", release_threads, 0),
+	EPOCHFS_OPT("release_queue=%u",	release_queue, 0),
+	EPOCHFS_OPT("trash_threshold=%llu", trash_threshold, 0),
+	EPOCHFS_OPT("max_background=%u", max_background, 0),
+	EPOCHFS_OPT("congestion_threshold=%u", congestion_threshold, 0),
+	FUSE_OPT_END
 };
 
 int main(int argc, char *argv[])
 {
 	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+	struct fuse_cmdline_opts opts;
+	struct fuse_loop_config *config;
+	struct fuse_session *se;
+	pthread_t stats_thread;
+	sigset_t sigset;
 	int rc;
 
 	rc = epochfs_init();
@@ -865,8 +5099,32 @@ int main(int argc, char *argv[])
 		return 1;
 	}
 
+	if (fuse_parse_cmdline(&args, &opts) != 0) {
+		return 1;
+	}
+	if (opts.show_help) {
+		epochfs_usage(argv[0]);
+		fuse_cmdline_help();
+		fuse_lowlevel_help();
+		rc = 0;
+		goto out_free;
+	}
+	if (opts.show_version) {
+		fuse_lowlevel_version();
+		rc = 0;
+		goto out_free;
+	}
+	if (opts.mountpoint == NULL) {
+		epochfs_usage(argv[0]);
+		rc = 1;
+		goto out_free;
+	}
+
 	// オプションを解析する。(epochfs_optsに従ってパラメータ設定を行う)
-	fuse_opt_parse(&args, &epochfs, epochfs_opts, NULL);
+	if (fuse_opt_parse(&args, &epochfs, epochfs_opts, NULL) == -1) {
+		rc = 1;
+		goto out_free;
+	}
 	if (strcmp(epochfs.base_path, "") == 0) {
 		fprintf(stderr,"ERROR: Missing 'base_path' option.\n");
 		EPOCHFS_DEBUG_LOG("ERROR: Missing 'base_path' option.%s", epochfs.base_path);
@@ -883,7 +5141,158 @@ int main(int argc, char *argv[])
 
 	EPOCHFS_DEBUG_LOG("epochfs.epoch=%d", epochfs.epoch);
 	EPOCHFS_DEBUG_LOG("epochfs.base_path=%s", epochfs.base_path);
-	return fuse_main(args.argc, args.argv, &epochfs_ope, NULL);
-}
 
+	/*
+	 * io_uringの通信路はlibfuseのセッションオプションで有効にする。
+	 * キューはCPUごとに作られ、各キューの処理スレッドはlibfuseが起動する。
+	 */
+#ifdef FUSE_CAP_OVER_IO_URING
+	if (epochfs.io_uring) {
+		char qdopt[64];
+
+		fuse_opt_add_arg(&args, "-oio_uring");
+		if (epochfs.io_uring_q_depth != 0) {
+			snprintf(qdopt, sizeof(qdopt), "-oio_uring_q_depth=%u",
+				 epochfs.io_uring_q_depth);
+			fuse_opt_add_arg(&args, qdopt);
+		}
+	}
+#endif
+
+	/*
+	 * default_permissionsはlibfuseのマウントオプションとしても渡す。
+	 * カーネルが権限を判定するため、accessは登録しない。
+	 */
+	epochfs.as_root = (geteuid() == 0);
+	if (epochfs.default_permissions) {
+		fuse_opt_add_arg(&args, "-odefault_permissions");
+		epochfs_ope.access = NULL;
+	}
+
+	// readdirplusを使わない場合はハンドラを登録しない
+	if (epochfs.readdirplus == EPOCHFS_READDIRPLUS_NO) {
+		epochfs_ope.readdirplus = NULL;
+	}
+
+	epochfs_nofile_init();
+	epochfs_dcache_init();
+	rc = epochfs_acache_init();
+	if (rc < 0) {
+		fprintf(stderr,"ERROR: cannot allocate attribute cache.\n");
+		rc = 1;
+		goto out_acache;
+	}
+
+	rc = epochfs_watch_init();
+	if (rc < 0) {
+		fprintf(stderr,"ERROR: cannot initialize inotify: %s\n",
+			strerror(-rc));
+		rc = 1;
+		goto out_acache;
+	}
+
+	// fuse_daemonize()でカレントディレクトリが変わる前に開いておく
+	rc = epochfs_root_init();
+	if (rc < 0) {
+		fprintf(stderr,"ERROR: cannot open base_path '%s': %s\n",
+			epochfs.base_path, strerror(-rc));
+		rc = 1;
+		goto out_acache;
+	}
+	rc = epochfs_trash_init();
+	if (rc < 0) {
+		fprintf(stderr,"ERROR: cannot open trash directory: %s\n",
+			strerror(-rc));
+		rc = 1;
+		goto out_itable;
+	}
+
+	rc = 1;
+	se = fuse_session_new(&args, &epochfs_ope, sizeof(epochfs_ope), NULL);
+	if (se == NULL) {
+		goto out_itable;
+	}
+	epochfs.se = se;
+	if (fuse_set_signal_handlers(se) != 0) {
+		goto out_session;
+	}
+	if (fuse_session_mount(se, opts.mountpoint) != 0) {
+		goto out_signal;
+	}
+
+	fuse_daemonize(opts.foreground);
+	if (!opts.foreground) {
+		openlog("epochfs", LOG_PID, LOG_DAEMON);
+		fuse_set_log_func(epochfs_syslog_func);
+	}
+
+	// SIGUSR1は統計出力スレッドだけが受け取る
+	sigemptyset(&sigset);
+	sigaddset(&sigset, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &sigset, NULL);
+	if (pthread_create(&stats_thread, NULL, epochfs_stats_thread, NULL) == 0) {
+		pthread_detach(stats_thread);
+	}
+
+	epochfs_uring_start();
+	if (epochfs_trash_start() < 0) {
+		fuse_log(FUSE_LOG_ERR, "epochfs: cannot start trash thread\n");
+		rc = 1;
+		goto out_unmount;
+	}
+	if (epochfs_closer_start() < 0) {
+		fuse_log(FUSE_LOG_ERR, "epochfs: cannot start closer threads\n");
+		rc = 1;
+		goto out_unmount;
+	}
+	if (epochfs_gsync_start() < 0) {
+		fuse_log(FUSE_LOG_ERR, "epochfs: cannot start fsync committer\n");
+		rc = 1;
+		goto out_unmount;
+	}
+	if (epochfs_syncer_start() < 0) {
+		fuse_log(FUSE_LOG_ERR, "epochfs: cannot start syncer\n");
+		rc = 1;
+		goto out_unmount;
+	}
+	if (epochfs_watch_start() < 0) {
+		fuse_log(FUSE_LOG_ERR, "epochfs: cannot start watcher\n");
+		rc = 1;
+		goto out_unmount;
+	}
+
+	if (opts.singlethread) {
+		rc = fuse_session_loop(se);
+	} else {
+		config = fuse_loop_cfg_create();
+		fuse_loop_cfg_set_clone_fd(config, opts.clone_fd);
+		fuse_loop_cfg_set_max_threads(config, opts.max_threads);
+		rc = fuse_session_loop_mt(se, config);
+		fuse_loop_cfg_destroy(config);
+	}
+
+	// 監視スレッドの停止と解放はepochfs_ll_destroy()で行う
+out_unmount:
+	fuse_session_unmount(se);
+out_signal:
+	fuse_remove_signal_handlers(se);
+out_session:
+	fuse_session_destroy(se);
+	epochfs_watch_stop();
+	epochfs_gsync_stop();
+	epochfs_uring_stop();
+	epochfs_closer_stop();
+	epochfs_syncer_stop();
+out_itable:
+	epochfs_trash_stop();
+	epochfs_itable_free();
+out_acache:
+	epochfs_acache_free();
+	epochfs_dcache_free();
+	epochfs_ino_free();
+out_free:
+	free(opts.mountpoint);
+	fuse_opt_free_args(&args);
+	return rc ? 1 : 0;
+}
 